@@ -1,11 +1,19 @@
-#include <avr/io.h>
-#include <avr/interrupt.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+
+#ifndef HOST_BUILD
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
 #include <util/delay.h>
+#include <util/twi.h>
+#endif
+// host/replay.c stands in for the AVR headers and includes this file to run it on a linux host
 
 // Setting, clearing, and reading bits in registers - (WRITE_BIT is a combination of CLEAR_BIT & SET_BIT)
 // Source: Lawrence Buckingham in CAB202 materials
@@ -21,6 +29,27 @@
 // 4-pin mode
 #define LCD_USING_4PIN_MODE (1)
 
+// transports - the byte-level layer (lcd_send, lcd_write4bits) comes from one of these
+#define LCD_TRANSPORT_GPIO 0    // six pins on PORTC, bit-banged with delays
+#define LCD_TRANSPORT_TWI 1     // PCF8574 I2C backpack on SDA/SCL, interrupt-driven
+#ifndef LCD_TRANSPORT
+#define LCD_TRANSPORT LCD_TRANSPORT_GPIO
+#endif
+
+#if LCD_TRANSPORT == LCD_TRANSPORT_TWI && !LCD_USING_4PIN_MODE
+#error "the PCF8574 backpack only wires D4-D7"
+#endif
+
+// PCF8574 backpack wiring (P0 = RS, P1 = R/W, P2 = E, P3 = backlight, P4-P7 = D4-D7) and bus settings
+#define LCD_TWI_ADDRESS 0x27
+#define LCD_TWI_FREQ 100000UL
+#define LCD_TWI_SCL_PIN 5
+#define LCD_PCF_RS (1 << 0)
+#define LCD_PCF_ENABLE (1 << 2)
+#define LCD_PCF_BACKLIGHT (1 << 3)
+#define LCD_PCF_POWER_ON 0xFF   // the expander's outputs come up high
+#define LCD_TWI_QUEUE_SIZE 128  // bytes waiting for the bus (power of two)
+
 // data port definitions
 #define LCD_DATA4_DDR (DDRC)
 #define LCD_DATA5_DDR (DDRC)
@@ -81,8 +110,19 @@
 #define LCD_5x10DOTS 0x04
 #define LCD_5x8DOTS 0x00
 
+// background initialisation states
+#define LCD_INIT_IDLE 0
+#define LCD_INIT_POWER_UP 1
+#define LCD_INIT_RETRY 2
+#define LCD_INIT_THIRD 3
+#define LCD_INIT_CONFIGURE 4
+#define LCD_INIT_ENTRY_MODE 5
+#define LCD_INIT_READY 6
+
 // functions
-void lcd_init(void);
+void lcd_init_start(bool warm);
+void lcd_init_step(void);
+bool lcd_is_ready(void);
 void lcd_write_string(uint8_t x, uint8_t y, char string[]);
 void lcd_write_char(uint8_t x, uint8_t y, char val);
 void lcd_clear(void);
@@ -107,29 +147,86 @@ void lcd_send(uint8_t, uint8_t);
 void lcd_write4bits(uint8_t);
 void lcd_write8bits(uint8_t);
 void lcd_pulseEnable(void);
+void lcd_transport_init(void);
+void lcd_transport_flush(void);
+void lcd_transport_drain(void);
+bool lcd_transport_busy(void);
+bool lcd_transport_failed(void);
 uint8_t _lcd_displayfunction;
 uint8_t _lcd_displaycontrol;
 uint8_t _lcd_displaymode;
+uint8_t _lcd_init_state;
+uint16_t _lcd_init_deadline;
+bool _lcd_init_warm;
+
+// TWI transport state - bytes are queued for the expander and sent by the TWI interrupt
+uint8_t _lcd_rs;
+uint8_t _lcd_twi_pins;
+volatile uint8_t _lcd_twi_queue[LCD_TWI_QUEUE_SIZE];
+volatile uint8_t _lcd_twi_head;
+volatile uint8_t _lcd_twi_tail;
+volatile bool _lcd_twi_active;
+volatile uint8_t _lcd_twi_errors;
+uint8_t _lcd_twi_errors_seen;
 
 // * END LCD DEFINITIONS * //
 
 
+// screen definitions - every screen is a fixed 2x16 template, with these variable fields
+#define SCREEN_WIDTH 16
+#define FIELD_ATTEMPTS_POS 0     // line 1, attempts remaining
+#define FIELD_NEW_CODE_POS 10    // line 2, masked digits while setting the code
+#define FIELD_TRY_CODE_POS 12    // line 2, masked digits while entering the code
+#define FIELD_COUNTDOWN_POS 14   // line 2, seconds left in a lockout
+#define FIELD_COUNTDOWN_WIDTH 2
+
+// led definitions
+#define RED_LED_PIN 3
+#define GREEN_LED_PIN 2
+#define LED_PWM_PERIOD 4         // system ticks per pwm cycle, so brightness runs 0 (off) to 4 (full)
+#define LED_STEP_MS 10           // pattern step durations are in units of 10 ms
+
+// a pattern is a table of steps, each holding both brightness levels and a duration,
+// ended by LED_HOLD (stay on the last step) or LED_REPEAT (start again)
+typedef struct {
+    uint8_t levels;
+    uint8_t duration;
+} led_step;
+
+#define LED_LEVELS(red, green) (((red) << 4) | (green))
+#define LED_HOLD { 0, 0 }
+#define LED_REPEAT { 1, 0 }
+
 // function declarations
 void uart_setup(unsigned int ubrr);
 void pin_setup();
 void interrupt_setup();
-void lcd_setup();
-void modify_string(char line1input[], char line2input[]);
+void lcd_setup(bool warm);
+void load_screen(const char screen[2][SCREEN_WIDTH]);
 void insert_char(int line, int pos, char input);
-void clear_string();
+void insert_number(int line, int pos, int width, int value);
 void display(char lcd_line1[], char lcd_line2[]);
 unsigned char uart_getchar(void);
 void uart_printchar(unsigned char data);
 void uart_printstring(char str[]);
 void timer_setup();
+void tick_setup();
+uint16_t system_time();
+uint32_t boot_time_us();
+void key_event(int number);
+void handle_press(int button_pressed);
+void replay_pending_keys();
+void keypad_dispatch();
+void trace_emit(uint8_t record);
+void trace_idle();
 void locked_display();
 void enable();
-void ftoa(float n, char * res, int afterpoint);
+void led_play(const led_step *pattern);
+void led_tick();
+void watchdog_setup();
+void watchdog_checkin(uint8_t task);
+void save_state();
+bool restore_state();
 
 // uart definitions
 #define BAUD 9600
@@ -139,70 +236,328 @@ void ftoa(float n, char * res, int afterpoint);
 #define FREQ (16000000.0)
 #define PRESCALE (1024.0)
 
+// system tick definitions - timer2 in CTC mode at 16 MHz / 64 / 250 = 1 kHz
+#define TICK_PRESCALE_BITS (1 << CS22)
+#define TICK_TOP 249
+#define TICK_COUNT_US 4
+
+// set BOOT_REPORT to 1 to print startup timings over UART once the LCD is ready
+#ifndef BOOT_REPORT
+#define BOOT_REPORT (0)
+#endif
+
+// presses held back while the LCD starts up
+#define PENDING_KEYS_MAX 8
+
+// keypad definitions
+// KEYPAD_DIRECT reads one button per pin (PB0-PB5, PD4-PD7) through the pin change interrupts.
+// KEYPAD_MATRIX scans a 4 row keypad from the system tick: rows on PD4-PD7 (driven low one at a time,
+// the rest left floating), columns on PB0-PB2 (PB0-PB3 for 4x4) with pull-ups.
+#define KEYPAD_DIRECT 0
+#define KEYPAD_MATRIX 1
+#ifndef KEYPAD_MODE
+#define KEYPAD_MODE KEYPAD_DIRECT
+#endif
+#ifndef KEYPAD_COLUMNS
+#define KEYPAD_COLUMNS 3
+#endif
+#define KEYPAD_ROWS 4
+#define KEYPAD_KEYS 16
+#define KEYPAD_ROW_PIN 4
+#define KEYPAD_COLUMN_MASK ((1 << KEYPAD_COLUMNS) - 1)
+
+// system ticks spent on each row, so a full scan takes KEYPAD_ROWS * KEYPAD_SCAN_TICKS ms
+#ifndef KEYPAD_SCAN_TICKS
+#define KEYPAD_SCAN_TICKS 1
+#endif
+
+// a key has to read the same for this many full scans before its state changes
+#define KEYPAD_DEBOUNCE_SCANS 3
+
+// presses the keypad can queue for the main loop (a power of two)
+#define KEYPAD_EVENTS_SIZE 8
+
+// key codes past the digits (the trace has room for all 16)
+#define KEY_STAR 10
+#define KEY_HASH 11
+#define KEY_A 12
+#define KEY_B 13
+#define KEY_C 14
+#define KEY_D 15
+
+// watchdog definitions - the watchdog is only reset once every supervised task has checked in
+#define WATCHDOG_TIMEOUT WDTO_250MS
+#define TASK_MAIN_LOOP 0
+#define TASK_SYSTEM_TICK 1
+#define TASKS_ALL ((1 << TASK_MAIN_LOOP) | (1 << TASK_SYSTEM_TICK))
+
+// state kept across a watchdog reset lives here - the C runtime leaves it alone at startup
+#define NOINIT __attribute__((section(".noinit")))
+#define SAVED_STATE_MAGIC 0x5AFE
+
+// passcode hash definitions - FNV-1a over the digits, then the salt, finished with the murmur3 mixer
+#define HASH_START 2166136261UL
+#define HASH_PRIME 16777619UL
+
+// key trace definitions
+// set TRACE_CAPTURE to 1 to interleave a compact trace of key presses and timer0 ticks with the UART output.
+// each record is TRACE_MARKER followed by one byte:
+//   0x00-0x7F  key press - bits 0-3 are the key code, bits 4-6 the ticks since the previous record
+//   0x80-0xFE  idle - (byte & 0x7F) ticks passed with no key press
+//   0xFF       start of trace, sent once at boot
+// a tick is one timer0 overflow at prescale 1024 (16.384 ms)
+#ifndef TRACE_CAPTURE
+#define TRACE_CAPTURE (0)
+#endif
+#define TRACE_MARKER 0x1E
+#define TRACE_START 0xFF
+#define TRACE_IDLE 0x80
+#define TRACE_IDLE_MASK 0x7F
+#define TRACE_MAX_IDLE 0x7E
+#define TRACE_MAX_KEY_GAP 7
+#define TRACE_TICK_US 16384UL
+
 // global variables
-char company_name[] = "O'DELL SECURITY";
-int code[4];
-int try_code[4];
+uint32_t code_salt;
+uint32_t code_digest;
+uint32_t entry_hash = HASH_START;
 int digits_pressed;
 bool locked = false;
 bool unlocked = false;
 bool disabled = false;
 int unlock_attempts = 3;
 
+// snapshot of the safe, checksummed so a warm restart only trusts it if it survived intact
+typedef struct {
+    uint16_t magic;
+    uint32_t code_salt;
+    uint32_t code_digest;
+    uint32_t entry_hash;
+    int digits_pressed;
+    int unlock_attempts;
+    int timer_overflow;
+    bool locked;
+    bool unlocked;
+    bool disabled;
+    char display_line1[SCREEN_WIDTH];
+    char display_line2[SCREEN_WIDTH];
+    uint16_t checksum;
+} safe_state;
+
+safe_state saved_state NOINIT;
+
+// MCUSR as it was at reset (cleared early so the watchdog can be turned off)
+uint8_t reset_flags NOINIT;
+
+// supervised tasks that have checked in since the watchdog was last reset
+volatile uint8_t watchdog_checkins;
+
 // for use with the timer interrupts
 volatile int timer_overflow;
 
-// two lines to be displayed on the lcd screen
-char display_line1[16];
-char display_line2[16];
+// timer0 ticks not yet written to the key trace
+volatile uint16_t trace_ticks;
+
+// milliseconds since the system tick started
+volatile uint16_t system_ms;
+
+// presses made before the LCD was ready, replayed in order afterwards (the next to replay is
+// pending_keys[pending_key_replayed])
+volatile int pending_keys[PENDING_KEYS_MAX];
+volatile uint8_t pending_key_count;
+volatile uint8_t pending_key_replayed;
+
+// current led pattern (both leds stay off until the first one is played)
+const led_step *volatile led_pattern;
+volatile uint8_t led_index;
+volatile uint16_t led_step_ticks;
+uint8_t led_red_level;
+uint8_t led_green_level;
+uint8_t led_phase;
+
+// matrix keypad scan state - one bit per key, at (row * 4 + column)
+uint8_t keypad_row;
+uint8_t keypad_divider;
+uint16_t keypad_raw;
+uint16_t keypad_history[KEYPAD_DEBOUNCE_SCANS];
+uint16_t keypad_state;
+uint16_t keypad_seen_ms[KEYPAD_KEYS];
+
+// presses from either keypad, waiting for the main loop - the key code and when it was first seen down
+typedef struct {
+    uint8_t key;
+    uint16_t seen_ms;
+} keypad_event;
+volatile keypad_event keypad_events[KEYPAD_EVENTS_SIZE];
+volatile uint8_t keypad_events_head;
+volatile uint8_t keypad_events_tail;
+
+// keypad statistics - latency runs from the button interrupt, or the first scan that saw a key down,
+// to the main loop handing it to key_event (a matrix press may have come up to one scan period earlier)
+typedef struct {
+    uint32_t scans;
+    uint16_t scan_rate;
+    uint16_t window_ms;
+    uint16_t window_scans;
+    uint16_t presses;
+    uint16_t latency_min;
+    uint16_t latency_max;
+    uint32_t latency_total;
+    uint16_t ghosted;
+} keypad_statistics;
+keypad_statistics keypad_stats;
+
+// key codes by matrix position, 4x4 layout (a 3x4 keypad just never reports the last column)
+const uint8_t keypad_map[KEYPAD_KEYS] PROGMEM = {
+    1, 2, 3, KEY_A,
+    4, 5, 6, KEY_B,
+    7, 8, 9, KEY_C,
+    KEY_STAR, 0, KEY_HASH, KEY_D
+};
+
+// startup timings, measured from the start of master_setup
+uint32_t boot_input_ready_us;
+uint32_t boot_lcd_ready_us;
+
+// two lines to be displayed on the lcd screen (the terminators are never written)
+char display_line1[SCREEN_WIDTH + 1];
+char display_line2[SCREEN_WIDTH + 1];
+
+// led patterns, stored in flash and stepped by the system tick
+const led_step led_locked[] PROGMEM = {
+    { LED_LEVELS(4, 0), 1 }, LED_HOLD
+};
+const led_step led_unlocked[] PROGMEM = {
+    { LED_LEVELS(0, 4), 1 }, LED_HOLD
+};
+const led_step led_granted[] PROGMEM = {
+    { LED_LEVELS(0, 4), 10 }, { LED_LEVELS(0, 0), 10 },
+    { LED_LEVELS(0, 4), 10 }, { LED_LEVELS(0, 0), 10 },
+    { LED_LEVELS(0, 4), 1 }, LED_HOLD
+};
+const led_step led_denied[] PROGMEM = {
+    { LED_LEVELS(0, 0), 10 }, { LED_LEVELS(4, 0), 10 },
+    { LED_LEVELS(0, 0), 10 }, { LED_LEVELS(4, 0), 10 },
+    { LED_LEVELS(0, 0), 10 }, { LED_LEVELS(4, 0), 1 }, LED_HOLD
+};
+const led_step led_lockout[] PROGMEM = {
+    { LED_LEVELS(1, 0), 15 }, { LED_LEVELS(2, 0), 15 }, { LED_LEVELS(3, 0), 15 },
+    { LED_LEVELS(4, 0), 30 }, { LED_LEVELS(3, 0), 15 }, { LED_LEVELS(2, 0), 15 },
+    { LED_LEVELS(1, 0), 15 }, { LED_LEVELS(0, 0), 30 }, LED_REPEAT
+};
+
+// screen templates, stored in flash and copied whole into the display lines
+const char screen_set_code[2][SCREEN_WIDTH] PROGMEM = {
+    "O'DELL SECURITY ",
+    "Set Code:       "
+};
+const char screen_locked[2][SCREEN_WIDTH] PROGMEM = {
+    "O'DELL SECURITY ",
+    "Enter Code:     "
+};
+const char screen_attempts[2][SCREEN_WIDTH] PROGMEM = {
+    "# Attempts Left ",
+    "Enter Code:     "
+};
+const char screen_last_attempt[2][SCREEN_WIDTH] PROGMEM = {
+    "1 Attempt Left  ",
+    "Enter Code:     "
+};
+const char screen_granted[2][SCREEN_WIDTH] PROGMEM = {
+    "Correct Code    ",
+    "Access Granted  "
+};
+const char screen_disabled[2][SCREEN_WIDTH] PROGMEM = {
+    "Safe Disabled.  ",
+    "Try again in:   "
+};
 
 void master_setup(void) {
+    // come back warm after a watchdog reset if the saved state survived, otherwise start cold
+    bool warm = BIT_IS_SET(reset_flags, WDRF) && restore_state();
+
+    // start the system tick first so startup can be timed
+    tick_setup();
+
     // setup I/O registers
     pin_setup();
 
     // setup uart communication
     uart_setup(MYUBRR);
 
-    // setup interrupt registers
+    #if TRACE_CAPTURE
+    // mark the start of the trace and keep timer0 running so idle time is recorded
+    trace_emit(TRACE_START);
+    timer_setup();
+    #endif
+
+    // setup interrupt registers - keys are accepted from here on
     interrupt_setup();
+    boot_input_ready_us = boot_time_us();
 
-    // setup LCD display
-    lcd_setup();
+    // start the LCD in the background
+    lcd_setup(warm);
 
     // print startup message
-    uart_printstring("// O'DELL SECURITY //\nSet your 4-digit code: ");  
+    if (warm) {
+        uart_printstring("\n\nRestarted - state restored.");
+    } else {
+        uart_printstring("// O'DELL SECURITY //\nSet your 4-digit code: ");  
+    }
+
+    // supervise everything from here on
+    watchdog_setup();
 }
 
 void process(void) {
-    // always send the two global lines to the lcd screen
-    display(display_line1, display_line2);
+    // bytes lost on the way to the display leave it out of step - start it again, as after a
+    // warm restart (the 8-bit resets put it back in 4-bit mode, then every cell is redrawn)
+    if (lcd_transport_failed()) lcd_init_start(true);
+
+    // presses are handled here rather than in the keypad interrupts, so their output can't hold up the tick
+    keypad_dispatch();
+
+    // step the LCD startup, then handle any presses made while it was starting
+    if (!lcd_is_ready()) {
+        lcd_init_step();
+        if (!lcd_is_ready()) return;
+
+        boot_lcd_ready_us = boot_time_us();
+        replay_pending_keys();
+
+        #if BOOT_REPORT
+        char report[72];
+        sprintf(report, "\n[boot: input %lu us, lcd %lu us]\n",
+            (unsigned long)boot_input_ready_us, (unsigned long)boot_lcd_ready_us);
+        uart_printstring(report);
+        #endif
+    }
 
     if (disabled) {
         // disable the safe for 1 minute after 3 incorrect attempts
         TCCR0A = 0;
 	    TCCR0B = 5;
 
-        char t[64];
         double elapsed = (timer_overflow * 256.0 + TCNT0) * PRESCALE / FREQ;
         double remaining = (61.0 - elapsed);
-        ftoa(remaining, t, 0);
-
-        lcd_write_string(14, 2, t);
+        insert_number(2, FIELD_COUNTDOWN_POS, FIELD_COUNTDOWN_WIDTH, (int)remaining);
 
         if (remaining < 1) enable();
     }
 
-    if (locked) {
-        // turn on red led and turn off green
-        SET_BIT(PORTD, 3);
-        CLEAR_BIT(PORTD, 2);
-    } else if (unlocked) {
-        // turn on green led and turn off red
-        SET_BIT(PORTD, 2);
-        CLEAR_BIT(PORTD, 3);
-    }
+    // always send the two global lines to the lcd screen (after the countdown, so it's never a pass behind)
+    display(display_line1, display_line2);
+
+    #if TRACE_CAPTURE
+    trace_idle();
+    #endif
+
+    // keep the lockout progress current, then check in
+    save_state();
+    watchdog_checkin(TASK_MAIN_LOOP);
 }
 
+#ifndef HOST_BUILD
 int main(void) {
     // run the setup function
     master_setup();
@@ -212,6 +567,7 @@ int main(void) {
         process();
     }
 }
+#endif
 
 
 // setup functions
@@ -224,6 +580,14 @@ void uart_setup(unsigned int ubrr) {
 }
 
 void pin_setup() {
+    #if KEYPAD_MODE == KEYPAD_MATRIX
+    // keypad rows float until the scan drives them (PORTD stays low, so no pull-ups),
+    // columns are inputs with pull-ups
+    DDRD &= ~(0x0F << KEYPAD_ROW_PIN);
+    PORTD &= ~(0x0F << KEYPAD_ROW_PIN);
+    DDRB &= ~KEYPAD_COLUMN_MASK;
+    PORTB |= KEYPAD_COLUMN_MASK;
+    #else
     // setup button DDR registers
     CLEAR_BIT(DDRD, 4);
     CLEAR_BIT(DDRD, 5);
@@ -235,42 +599,191 @@ void pin_setup() {
     CLEAR_BIT(DDRB, 3);
     CLEAR_BIT(DDRB, 4);
     CLEAR_BIT(DDRB, 5);
+    #endif
 
     // setup LED DDR registers
-    SET_BIT(DDRD, 2);
-    SET_BIT(DDRD, 3);
+    SET_BIT(DDRD, GREEN_LED_PIN);
+    SET_BIT(DDRD, RED_LED_PIN);
 }
 
 void interrupt_setup() {
     // global interrupts
     sei();
     
+    #if KEYPAD_MODE == KEYPAD_DIRECT
     // pinchange interrupts
     PCICR = (1 << PCIE0) | (1 << PCIE2);
     PCMSK0 = (1 << PCINT0) | (1 << PCINT1) | (1 << PCINT2) | (1 << PCINT3) | (1 << PCINT4) | (1 << PCINT5);
     PCMSK2 = (1 << PCINT20) | (1 << PCINT21) | (1 << PCINT22) | (1 << PCINT23);
+    #endif
     
     // timer interrupt
     TIMSK0 = 1;
 }
 
-void lcd_setup() {
-    // setup lcd and display startup message
-    lcd_init();
-    modify_string(company_name, "Set Code:");
+void timer_setup() {
+    // free-running timer0 at prescale 1024 (same settings used by the lockout countdown)
+    TCCR0A = 0;
+    TCCR0B = 5;
+}
+
+void tick_setup() {
+    // 1 ms system tick on timer2 compare match A
+    TCCR2A = (1 << WGM21);
+    OCR2A = TICK_TOP;
+    TCNT2 = 0;
+    TCCR2B = TICK_PRESCALE_BITS;
+    TIMSK2 = (1 << OCIE2A);
 }
 
+void lcd_setup(bool warm) {
+    // start the lcd and set the startup message (drawn once the lcd is ready) - a warm
+    // restart keeps the restored display lines and skips the power-up wait
+    lcd_init_start(warm);
+    if (!warm) load_screen(screen_set_code);
+}
 
-// auxiliary functions
-void modify_string(char line1input[], char line2input[]) {
-    // change the lcd display strings
-    for (int i = 0; i < strlen(line1input); i++) {
-        display_line1[i] = line1input[i];
+void watchdog_setup() {
+    // the watchdog fires if any supervised task stops checking in
+    watchdog_checkins = 0;
+    wdt_enable(WATCHDOG_TIMEOUT);
+}
+
+#ifndef HOST_BUILD
+// runs before main: keep the reset cause and stop the watchdog, which stays on after it fires
+void get_reset_flags(void) __attribute__((naked, used, section(".init3")));
+void get_reset_flags(void) {
+    reset_flags = MCUSR;
+    MCUSR = 0;
+    wdt_disable();
+}
+#endif
+
+
+// system time
+uint16_t system_time() {
+    // read the tick count atomically
+    cli();
+    uint16_t now = system_ms;
+    sei();
+    return now;
+}
+
+uint32_t boot_time_us() {
+    // whole ticks plus the partial tick counted by timer2
+    cli();
+    uint16_t ms = system_ms;
+    uint8_t count = TCNT2;
+    if (BIT_IS_SET(TIFR2, OCF2A) && count < TICK_TOP) ms++;
+    sei();
+
+    return ms * 1000UL + count * TICK_COUNT_US;
+}
+
+
+// watchdog and warm restart
+void watchdog_checkin(uint8_t task) {
+    // record a task as alive, and reset the watchdog once all of them are
+    uint8_t sreg = SREG;
+    cli();
+    watchdog_checkins |= (1 << task);
+    if (watchdog_checkins == TASKS_ALL) {
+        wdt_reset();
+        watchdog_checkins = 0;
+    }
+    SREG = sreg;
+}
+
+uint16_t state_checksum(const safe_state *state) {
+    // fletcher-16 over everything before the checksum field. The sums are only reduced once per
+    // block - 20 bytes is as many as 16 bit sums can take - so there are 6 divisions, not 110
+    const uint8_t *bytes = (const uint8_t *)state;
+    size_t length = offsetof(safe_state, checksum);
+    uint16_t sum1 = 0, sum2 = 0;
+
+    while (length > 0) {
+        size_t block = length > 20 ? 20 : length;
+        length -= block;
+        while (block--) {
+            sum1 += *bytes++;
+            sum2 += sum1;
+        }
+        sum1 %= 255;
+        sum2 %= 255;
+    }
+
+    return (sum2 << 8) | sum1;
+}
+
+void save_state() {
+    // copy the safe into .noinit - safe from both interrupts and the main loop.
+    // Most main loop passes change nothing, and then nothing is written
+    safe_state state;
+    memset(&state, 0, sizeof(state));
+    uint8_t sreg = SREG;
+    cli();
+
+    state.magic = SAVED_STATE_MAGIC;
+    state.code_salt = code_salt;
+    state.code_digest = code_digest;
+    state.entry_hash = entry_hash;
+    state.digits_pressed = digits_pressed;
+    state.unlock_attempts = unlock_attempts;
+    state.timer_overflow = timer_overflow;
+    state.locked = locked;
+    state.unlocked = unlocked;
+    state.disabled = disabled;
+    memcpy(state.display_line1, display_line1, SCREEN_WIDTH);
+    memcpy(state.display_line2, display_line2, SCREEN_WIDTH);
+
+    if (memcmp(&state, &saved_state, offsetof(safe_state, checksum)) != 0) {
+        state.checksum = state_checksum(&state);
+        saved_state = state;
+    }
+
+    SREG = sreg;
+}
+
+bool restore_state() {
+    // only trust a snapshot that is intact and in range
+    if (saved_state.magic != SAVED_STATE_MAGIC || saved_state.checksum != state_checksum(&saved_state)) {
+        return false;
+    }
+    if (saved_state.digits_pressed < 0 || saved_state.digits_pressed > 4
+        || saved_state.unlock_attempts < 1 || saved_state.unlock_attempts > 3) {
+        return false;
     }
 
-    for (int q = 0; q < strlen(line2input); q++) {
-        display_line2[q] = line2input[q];
+    code_salt = saved_state.code_salt;
+    code_digest = saved_state.code_digest;
+    entry_hash = saved_state.entry_hash;
+    digits_pressed = saved_state.digits_pressed;
+    unlock_attempts = saved_state.unlock_attempts;
+    timer_overflow = saved_state.timer_overflow;
+    locked = saved_state.locked;
+    unlocked = saved_state.unlocked;
+    disabled = saved_state.disabled;
+    memcpy(display_line1, saved_state.display_line1, SCREEN_WIDTH);
+    memcpy(display_line2, saved_state.display_line2, SCREEN_WIDTH);
+
+    // pick the leds back up (a lockout carries on from where it was)
+    if (disabled) {
+        led_play(led_lockout);
+    } else if (locked) {
+        led_play(led_locked);
+    } else if (unlocked) {
+        led_play(led_unlocked);
     }
+
+    return true;
+}
+
+
+// auxiliary functions
+void load_screen(const char screen[2][SCREEN_WIDTH]) {
+    // copy a whole template from flash into the lcd display strings
+    memcpy_P(display_line1, screen[0], SCREEN_WIDTH);
+    memcpy_P(display_line2, screen[1], SCREEN_WIDTH);
 }
 
 void insert_char(int line, int pos, char input) {
@@ -282,11 +795,11 @@ void insert_char(int line, int pos, char input) {
     }
 }
 
-void clear_string() {
-    // fill both strings with whitespace (avoids leftover characters from the previous string being displayed)
-    for (int i = 0; i < 16; i++) {
-        display_line1[i] = ' ';
-        display_line2[i] = ' ';
+void insert_number(int line, int pos, int width, int value) {
+    // insert a right-aligned number into a lcd display string, padding with spaces
+    for (int i = width - 1; i >= 0; i--) {
+        insert_char(line, pos + i, (value > 0 || i == width - 1) ? '0' + value % 10 : ' ');
+        value /= 10;
     }
 }
 
@@ -306,6 +819,10 @@ void uart_printchar(unsigned char character) {
     
     // send data
     UDR0 = character; 	
+
+    #ifdef HOST_BUILD
+    host_uart_capture(character);
+    #endif
 }
 
 void uart_printstring(char str[]) {
@@ -323,52 +840,154 @@ void uart_printstring(char str[]) {
 }
 
 
-// codes and comparison
+// leds
+void led_play(const led_step *pattern) {
+    // start a pattern from its first step - safe from both interrupts and the main loop
+    uint8_t sreg = SREG;
+    cli();
+    led_pattern = pattern;
+    led_index = 0;
+    led_step_ticks = 1;
+    SREG = sreg;
+}
+
+void led_tick() {
+    // software pwm - each led is on for 'level' ticks of every LED_PWM_PERIOD
+    led_phase = (led_phase + 1) % LED_PWM_PERIOD;
+    WRITE_BIT(PORTD, RED_LED_PIN, led_red_level > led_phase);
+    WRITE_BIT(PORTD, GREEN_LED_PIN, led_green_level > led_phase);
+
+    // move through the pattern (a step count of 0 means hold)
+    if (led_step_ticks == 0 || --led_step_ticks > 0) return;
+
+    const led_step *step = &led_pattern[led_index];
+    uint8_t duration = pgm_read_byte(&step->duration);
+    uint8_t levels = pgm_read_byte(&step->levels);
+
+    if (duration == 0) {
+        // end of the table - start again, or stay on the last step
+        if (levels == 0) return;
+        led_index = 0;
+        step = led_pattern;
+        duration = pgm_read_byte(&step->duration);
+        levels = pgm_read_byte(&step->levels);
+    }
+
+    led_red_level = levels >> 4;
+    led_green_level = levels & 0x0F;
+    led_step_ticks = duration * LED_STEP_MS;
+    led_index++;
+}
+
+
+// key trace
+void trace_emit(uint8_t record) {
+    // send one trace record, marked so it can be pulled out of the normal UART text
+    uart_printchar(TRACE_MARKER);
+    uart_printchar(record);
+}
+
+void trace_flush_ticks(uint16_t keep) {
+    // send idle records until at most 'keep' ticks are still pending
+    while (trace_ticks > keep) {
+        uint16_t ticks = trace_ticks - keep;
+        if (ticks > TRACE_MAX_IDLE) ticks = TRACE_MAX_IDLE;
+
+        trace_emit(TRACE_IDLE | ticks);
+        trace_ticks -= ticks;
+    }
+}
+
+void trace_key(int number) {
+    // called with interrupts off, so the tick count can't change underneath us
+    trace_flush_ticks(TRACE_MAX_KEY_GAP);
+    trace_emit((trace_ticks << 4) | number);
+    trace_ticks = 0;
+}
+
+void trace_idle() {
+    // called from the main loop - hold off interrupts so records aren't split by a key press
+    if (trace_ticks >= TRACE_MAX_IDLE) {
+        cli();
+        trace_flush_ticks(TRACE_MAX_IDLE - 1);
+        sei();
+    }
+}
+
+
+// codes and comparison - only a salted digest of the code is kept, and digits are hashed as they arrive
+uint32_t hash_byte(uint32_t hash, uint8_t byte) {
+    // one FNV-1a step
+    hash ^= byte;
+    return hash * HASH_PRIME;
+}
+
+uint32_t hash_finish(uint32_t hash, uint32_t salt) {
+    // fold in the salt and mix every digit into every bit - no branches, so any code takes as long.
+    // six 32 bit multiplies (__mulsi3, about 40 cycles each with the hardware multiplier) plus byte
+    // moves and xors: an estimated 500 cycles, and under 600 (38 us at 16 MHz) with codes_match.
+    // That is a hand count - nothing here has been run on a cycle-accurate simulator yet
+    for (int i = 0; i < 4; i++) {
+        hash = hash_byte(hash, salt);
+        salt >>= 8;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6BUL;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35UL;
+    hash ^= hash >> 16;
+    return hash;
+}
+
 void code_add(int number) {
-    // update passcode and increment control variable
-    code[digits_pressed] = number;
+    // hash the digit into the new code, and the timing of the press into its salt
+    if (digits_pressed == 0) entry_hash = HASH_START;
+    entry_hash = hash_byte(entry_hash, number);
+    code_salt = hash_byte(code_salt, TCNT2 ^ TCNT0 ^ (uint8_t)system_ms);
     digits_pressed++;
+
+    // keep just the digest once the code is complete
+    if (digits_pressed == 4) {
+        code_digest = hash_finish(entry_hash, code_salt);
+        entry_hash = HASH_START;
+    }
 }
 
 void try_code_add(int number) {
-    // update the attempt code and increment control variable
-    try_code[digits_pressed] = number;
+    // hash the digit into the attempt and increment control variable
+    if (digits_pressed == 0) entry_hash = HASH_START;
+    entry_hash = hash_byte(entry_hash, number);
     digits_pressed++;
 }
 
 bool codes_match() {
-    // compare the entered code with the correct one
+    // compare every byte of the digests without stopping at the first difference,
+    // so a wrong attempt takes the same time wherever it is wrong
+    uint32_t attempt = hash_finish(entry_hash, code_salt);
+    uint32_t digest = code_digest;
+    uint8_t difference = 0;
     digits_pressed = 0;
-    
+
     for (int i = 0; i < 4; i++) {
-        if (try_code[i] != code[i]) {
-            return false;
-        }
+        difference |= (uint8_t)attempt ^ (uint8_t)digest;
+        attempt >>= 8;
+        digest >>= 8;
     }
 
     // return true if no differences
-    return true;
+    return difference == 0;
 }
 
 
 // safe functions
 void locked_display() {
-    // convert number of attempts to character for lcd display
-    int attempt_int = unlock_attempts;
-    char attempt_char[1];
-    sprintf(attempt_char, "%d", attempt_int);
-    
-    // reset string
-    clear_string();
-    
     // display attempts and enter prompt, taking (s) into account
     if (unlock_attempts == 1) {
-        modify_string("  Attempt Left", "Enter Code:");
-    } else
-    {
-        modify_string("  Attempts Left", "Enter Code:");
+        load_screen(screen_last_attempt);
+    } else {
+        load_screen(screen_attempts);
+        insert_number(1, FIELD_ATTEMPTS_POS, 1, unlock_attempts);
     }
-    insert_char(1, 0, attempt_char[0]);
 }
 
 void lock_safe() {
@@ -376,14 +995,13 @@ void lock_safe() {
     locked = true;
     digits_pressed = 0;
 
-    // print to UART
+    // LEDs and UART
+    led_play(led_locked);
     uart_printstring("\n\nCode Set - Safe Locked.");
     uart_printstring("\nEnter Code: ");
     
     // send to LCD
-    lcd_clear();
-    clear_string();
-    modify_string(company_name, "Enter Code:");
+    load_screen(screen_locked);
 }
 
 
@@ -395,12 +1013,12 @@ void access_granted() {
     locked = false;
     
     // reset attempt code
-    memset(try_code, 0, 4);
+    entry_hash = HASH_START;
     
-    // UART and LCD
+    // LEDs, UART and LCD
+    led_play(led_granted);
     uart_printstring("\nCorrect Code // Access Granted");
-    clear_string();
-    modify_string("Correct Code", "Access Granted");
+    load_screen(screen_granted);
 }
 
 void access_denied() {
@@ -409,9 +1027,13 @@ void access_denied() {
     unlock_attempts--;
 
     // reset attempt code
-    memset(try_code, 0, 4);
+    entry_hash = HASH_START;
+
+    // save the used attempt before anything slow that could hang
+    save_state();
     
-    // UART and LCD
+    // LEDs, UART and LCD
+    led_play(led_denied);
     uart_printstring("\nIncorrect Code // Access Denied");
     uart_printstring("\nEnter Code: ");
     locked_display();
@@ -422,10 +1044,13 @@ void disable() {
     timer_overflow = 0;
     disabled = true;
 
-    // UART and LCD
+    // save the lockout before anything slow that could hang
+    save_state();
+
+    // LEDs, UART and LCD
+    led_play(led_lockout);
     uart_printstring("\n\nToo many attempts. Safe temporarily disabled.");
-    clear_string();
-    modify_string("Safe Disabled.", "Try again in:");
+    load_screen(screen_disabled);
 }
 
 void enable() {
@@ -434,42 +1059,214 @@ void enable() {
     unlock_attempts = 3;
     digits_pressed = 0;
 
-    // UART and LCD
-    lcd_clear();
-    clear_string();
+    // LEDs, UART and LCD
+    led_play(led_locked);
     uart_printstring("\n\nSafe enabled. Enter Code: ");
-    modify_string("3 Attempts Left", "Enter Code:");
+    locked_display();
 }
 
 
 // button press handler
+void key_event(int number) {
+    // entry point for every key press, from the main loop
+    #if TRACE_CAPTURE
+    uint8_t sreg = SREG;
+    cli();
+    trace_key(number);
+    SREG = sreg;
+    #endif
+
+    // hold presses back until the lcd is ready, and behind any still waiting to be replayed
+    if (!lcd_is_ready() || pending_key_count > 0) {
+        if (pending_key_count < PENDING_KEYS_MAX) {
+            pending_keys[pending_key_count++] = number;
+        }
+        return;
+    }
+
+    handle_press(number);
+}
+
+void replay_pending_keys() {
+    // run presses buffered during startup in order, as if their interrupts had just fired. Each key
+    // is taken with interrupts off but handled with them on, so its output doesn't hold up the tick -
+    // presses made meanwhile join the end of the buffer, until it's empty
+    for (;;) {
+        cli();
+        if (pending_key_replayed == pending_key_count) {
+            pending_key_count = pending_key_replayed = 0;
+            sei();
+            return;
+        }
+        int number = pending_keys[pending_key_replayed++];
+        sei();
+
+        handle_press(number);
+    }
+}
+
+void clear_entry() {
+    // * drops the digits entered so far
+    if (disabled || digits_pressed == 0) return;
+
+    int pos = locked ? FIELD_TRY_CODE_POS : FIELD_NEW_CODE_POS;
+    for (int i = 0; i < digits_pressed; i++) {
+        insert_char(2, pos + i, ' ');
+    }
+    digits_pressed = 0;
+
+    uart_printstring(locked ? "\nCleared. Enter Code: " : "\nCleared. Set your 4-digit code: ");
+}
+
+void keypad_report() {
+    // # prints the matrix scanner statistics
+    char report[96];
+    uint16_t average = keypad_stats.presses ? keypad_stats.latency_total / keypad_stats.presses : 0;
+    sprintf(report, "\n[keypad: %u scans/s, latency %u-%u ms (avg %u), %u presses, %u ghosted]\n",
+        keypad_stats.scan_rate, keypad_stats.latency_min, keypad_stats.latency_max, average,
+        keypad_stats.presses, keypad_stats.ghosted);
+    uart_printstring(report);
+}
+
+void function_key(int key) {
+    // keys past the digits only exist on the matrix keypad - A to D are unassigned
+    if (key == KEY_STAR) {
+        clear_entry();
+    } else if (key == KEY_HASH) {
+        keypad_report();
+    }
+}
+
+bool keypad_ghosted(uint16_t keys) {
+    // with no diodes, three keys on the corners of a rectangle make the fourth read as pressed,
+    // so any two rows sharing two or more columns can't be trusted
+    for (int a = 0; a < KEYPAD_ROWS - 1; a++) {
+        for (int b = a + 1; b < KEYPAD_ROWS; b++) {
+            uint8_t shared = (keys >> (a * 4)) & (keys >> (b * 4)) & 0x0F;
+            if (shared & (shared - 1)) return true;
+        }
+    }
+    return false;
+}
+
+void keypad_queue(uint8_t key, uint16_t seen_ms) {
+    // called from the keypad interrupts - if the main loop is that far behind, drop the press
+    // (as pending_keys does)
+    uint8_t next = (keypad_events_head + 1) & (KEYPAD_EVENTS_SIZE - 1);
+    if (next == keypad_events_tail) return;
+
+    keypad_events[keypad_events_head].key = key;
+    keypad_events[keypad_events_head].seen_ms = seen_ms;
+    keypad_events_head = next;
+}
+
+void keypad_scan_done(uint16_t raw) {
+    // debounce a full scan and raise an event for every key that went down
+    uint16_t now = system_ms;
+    keypad_stats.scans++;
+    keypad_stats.window_scans++;
+
+    // remember when each key was first seen down, for the latency figures
+    uint16_t appeared = raw & ~keypad_history[0];
+    for (int key = 0; appeared; key++, appeared >>= 1) {
+        if (appeared & 1) keypad_seen_ms[key] = now;
+    }
+
+    // a key's state only changes once it has read the same for every remembered scan
+    uint16_t down_all = raw, down_any = raw;
+    for (int i = KEYPAD_DEBOUNCE_SCANS - 1; i > 0; i--) {
+        keypad_history[i] = keypad_history[i - 1];
+        down_all &= keypad_history[i];
+        down_any |= keypad_history[i];
+    }
+    keypad_history[0] = raw;
+
+    // hold the current state while the matrix is ambiguous
+    if (keypad_ghosted(raw)) {
+        keypad_stats.ghosted++;
+        return;
+    }
+
+    uint16_t state = (keypad_state | down_all) & down_any;
+    uint16_t pressed = state & ~keypad_state;
+    keypad_state = state;
+
+    // n-key rollover - every new key gets its own event, whatever else is held
+    for (int key = 0; pressed; key++, pressed >>= 1) {
+        if (pressed & 1) keypad_queue(pgm_read_byte(&keypad_map[key]), keypad_seen_ms[key]);
+    }
+}
+
+void keypad_dispatch() {
+    // hand the queued presses to key_event, oldest first
+    while (keypad_events_tail != keypad_events_head) {
+        keypad_event event = keypad_events[keypad_events_tail];
+        keypad_events_tail = (keypad_events_tail + 1) & (KEYPAD_EVENTS_SIZE - 1);
+
+        uint16_t latency = system_time() - event.seen_ms;
+        if (keypad_stats.presses == 0 || latency < keypad_stats.latency_min) keypad_stats.latency_min = latency;
+        if (latency > keypad_stats.latency_max) keypad_stats.latency_max = latency;
+        keypad_stats.latency_total += latency;
+        keypad_stats.presses++;
+
+        key_event(event.key);
+    }
+}
+
+void keypad_scan_tick() {
+    // called from the system tick - read the row driven since the last step, then drive the next one
+    if (++keypad_stats.window_ms == 1000) {
+        keypad_stats.scan_rate = keypad_stats.window_scans;
+        keypad_stats.window_scans = keypad_stats.window_ms = 0;
+    }
+
+    if (++keypad_divider < KEYPAD_SCAN_TICKS) return;
+    keypad_divider = 0;
+
+    // a pressed key pulls its column low
+    uint8_t columns = ~PINB & KEYPAD_COLUMN_MASK;
+    keypad_raw |= (uint16_t)columns << (keypad_row * 4);
+
+    // only one row is ever an output, so holding keys in two rows can't short them together
+    CLEAR_BIT(DDRD, KEYPAD_ROW_PIN + keypad_row);
+    keypad_row = (keypad_row + 1) % KEYPAD_ROWS;
+    SET_BIT(DDRD, KEYPAD_ROW_PIN + keypad_row);
+
+    if (keypad_row == 0) {
+        keypad_scan_done(keypad_raw);
+        keypad_raw = 0;
+    }
+}
+
 void handle_press(int button_pressed) {
     
+    if (button_pressed > 9) {
+        function_key(button_pressed);
+        return;
+    }
+
+    // digits are ignored during a lockout, rather than counting towards another one
+    if (disabled) return;
+
     if (!locked && !disabled) {
         // append the passcode
         code_add(button_pressed);
 
         // print using uart
-        char num[1];
-        sprintf(num, "%d", button_pressed);
-        uart_printchar((unsigned char)num[0]);
+        uart_printchar('0' + button_pressed);
         
         // display on LCD (hidden)
-        if (digits_pressed == 1) insert_char(2, 9, ' ');
-        insert_char(2, 9 + digits_pressed, '*');
+        insert_char(2, FIELD_NEW_CODE_POS + digits_pressed - 1, '*');
 
     } else if (locked && !disabled) {
         // append the attempt passcode
         try_code_add(button_pressed);
         
         // print using uart
-        char try_num[1];
-        sprintf(try_num, "%d", button_pressed);
-        uart_printchar((unsigned char)try_num[0]);
+        uart_printchar('0' + button_pressed);
 
         // display on LCD (hidden)
-        if (digits_pressed == 1) insert_char(2, 11, ' ');
-        insert_char(2, 11 + digits_pressed, '*');
+        insert_char(2, FIELD_TRY_CODE_POS + digits_pressed - 1, '*');
         
     }
 
@@ -477,14 +1274,13 @@ void handle_press(int button_pressed) {
         if (!locked) {
             lock_safe();
         } else if (locked) {
-            if (unlock_attempts == 1) {
+            // check the code first, so the last attempt can still open the safe
+            if (codes_match()) {
+                access_granted();
+            } else if (unlock_attempts == 1) {
                 disable();
             } else {
-                if (codes_match() && !disabled) {
-                    access_granted();
-                } else if (!codes_match() && !disabled) {
-                    access_denied();
-                }  
+                access_denied();
             }
         } 
     }
@@ -492,92 +1288,49 @@ void handle_press(int button_pressed) {
 
 
 // interrupt service routines
+#if KEYPAD_MODE == KEYPAD_DIRECT
 ISR(PCINT0_vect) {
-    // PORT B buttons
-    if (BIT_IS_SET(PINB, 5)) handle_press(1);
-    if (BIT_IS_SET(PINB, 4)) handle_press(2);
-    if (BIT_IS_SET(PINB, 3)) handle_press(3);
-    if (BIT_IS_SET(PINB, 2)) handle_press(4);
-    if (BIT_IS_SET(PINB, 1)) handle_press(5);
-    if (BIT_IS_SET(PINB, 0)) handle_press(6);
+    // PORT B buttons - queued for the main loop
+    if (BIT_IS_SET(PINB, 5)) keypad_queue(1, system_ms);
+    if (BIT_IS_SET(PINB, 4)) keypad_queue(2, system_ms);
+    if (BIT_IS_SET(PINB, 3)) keypad_queue(3, system_ms);
+    if (BIT_IS_SET(PINB, 2)) keypad_queue(4, system_ms);
+    if (BIT_IS_SET(PINB, 1)) keypad_queue(5, system_ms);
+    if (BIT_IS_SET(PINB, 0)) keypad_queue(6, system_ms);
 }
 
 ISR(PCINT2_vect) {
-    // PORT D buttons
-    if (BIT_IS_SET(PIND, 7)) handle_press(7);
-    if (BIT_IS_SET(PIND, 6)) handle_press(8);
-    if (BIT_IS_SET(PIND, 5)) handle_press(9);
-    if (BIT_IS_SET(PIND, 4)) handle_press(0);
+    // PORT D buttons - queued for the main loop
+    if (BIT_IS_SET(PIND, 7)) keypad_queue(7, system_ms);
+    if (BIT_IS_SET(PIND, 6)) keypad_queue(8, system_ms);
+    if (BIT_IS_SET(PIND, 5)) keypad_queue(9, system_ms);
+    if (BIT_IS_SET(PIND, 4)) keypad_queue(0, system_ms);
+}
+#endif
+
+ISR(TIMER2_COMPA_vect) {
+    // system tick
+    system_ms++;
+    led_tick();
+    #if KEYPAD_MODE == KEYPAD_MATRIX
+    keypad_scan_tick();
+    #endif
+    watchdog_checkin(TASK_SYSTEM_TICK);
 }
 
 ISR(TIMER0_OVF_vect) {
 	// timer
     timer_overflow++;
-}
-
-
-// * TIMER FUNCTIONS - Source: Lawrence Buckingham in CAB202 materials * //
 
-// Reverses a string 'str' of length 'len' 
-void reverse(char * str, int len) {
-  int i = 0, j = len - 1, temp;
-  while (i < j) {
-    temp = str[i];
-    str[i] = str[j];
-    str[j] = temp;
-    i++;
-    j--;
-  }
-}
-
-// Converts a given integer x to string str[].
-int intToStr(int x, char str[], int d) {
-  int i = 0;
-  while (x) {
-    str[i++] = (x % 10) + '0';
-    x = x / 10;
-  }
-
-  // If number of digits required is more, then 
-  // add 0s at the beginning 
-  while (i < d)
-    str[i++] = '0';
-
-  reverse(str, i);
-  str[i] = '\0';
-  return i;
-}
-
-// Converts a floating-point/double number to a string. 
-void ftoa(float n, char * res, int afterpoint) {
-  // Extract integer part 
-  int ipart = (int) n;
-
-  // Extract floating part 
-  float fpart = n - (float) ipart;
-
-  // convert integer part to string 
-  int i = intToStr(ipart, res, 0);
-
-  // check for display option after point 
-  if (afterpoint != 0) {
-    res[i] = '.'; // add dot 
-
-    // Get the value of fraction part upto given no. 
-    // of points after dot. The third parameter  
-    // is needed to handle cases like 233.007 
-    fpart = fpart * pow(10, afterpoint);
-
-    intToStr((int) fpart, res + i + 1, afterpoint);
-  }
+    #if TRACE_CAPTURE
+    trace_ticks++;
+    #endif
 }
 
-// * END TIMER FUCNTIONS * //
-
 
 // * LCD FUNCTIONS - Source: Lawrence Buckingham in CAB202 materials * //
 
-void lcd_init(void){
+void lcd_init_start(bool warm){
   //dotsize
   if (LCD_USING_4PIN_MODE){
     _lcd_displayfunction = LCD_4BITMODE | LCD_1LINE | LCD_5x8DOTS;
@@ -587,88 +1340,116 @@ void lcd_init(void){
   
   _lcd_displayfunction |= LCD_2LINE;
 
-  // RS Pin
-  LCD_RS_DDR |= (1 << LCD_RS_PIN);
-  // Enable Pin
-  LCD_ENABLE_DDR |= (1 << LCD_ENABLE_PIN);
-  
-  #if LCD_USING_4PIN_MODE
-    //Set DDR for all the data pins
-    LCD_DATA4_DDR |= (1 << LCD_DATA4_PIN);
-    LCD_DATA5_DDR |= (1 << LCD_DATA5_PIN);
-    LCD_DATA6_DDR |= (1 << LCD_DATA6_PIN);    
-    LCD_DATA7_DDR |= (1 << LCD_DATA7_PIN);
-
-  #else
-    //Set DDR for all the data pins
-    LCD_DATA0_DDR |= (1 << LCD_DATA0_PIN);
-    LCD_DATA1_DDR |= (1 << LCD_DATA1_PIN);
-    LCD_DATA2_DDR |= (1 << LCD_DATA2_PIN);
-    LCD_DATA3_DDR |= (1 << LCD_DATA3_PIN);
-    LCD_DATA4_DDR |= (1 << LCD_DATA4_PIN);
-    LCD_DATA5_DDR |= (1 << LCD_DATA5_PIN);
-    LCD_DATA6_DDR |= (1 << LCD_DATA6_PIN);
-    LCD_DATA7_DDR |= (1 << LCD_DATA7_PIN);
-  #endif 
+  // pins or bus for the chosen transport
+  lcd_transport_init();
 
   // SEE PAGE 45/46 OF Hitachi HD44780 DATASHEET FOR INITIALIZATION SPECIFICATION!
 
   // according to datasheet, we need at least 40ms after power rises above 2.7V
-  // before sending commands. Arduino can turn on way before 4.5V so we'll wait 50
-  _delay_us(50000); 
-  // Now we pull both RS and Enable low to begin commands (R/W is wired to ground)
-  LCD_RS_PORT &= ~(1 << LCD_RS_PIN);
-  LCD_ENABLE_PORT &= ~(1 << LCD_ENABLE_PIN);
-  
-  //put the LCD into 4 bit or 8 bit mode
-  if (LCD_USING_4PIN_MODE) {
-    // this is according to the hitachi HD44780 datasheet
-    // figure 24, pg 46
-
-    // we start in 8bit mode, try to set 4 bit mode
-    lcd_write4bits(0b0111);
-    _delay_us(4500); // wait min 4.1ms
-
-    // second try
-    lcd_write4bits(0b0111);
-    _delay_us(4500); // wait min 4.1ms
-    
-    // third go!
-    lcd_write4bits(0b0111); 
-    _delay_us(150);
-
-    // finally, set to 4-bit interface
-    lcd_write4bits(0b0010); 
-  } else {
-    // this is according to the hitachi HD44780 datasheet
-    // page 45 figure 23
-
-    // Send function set command sequence
-    lcd_command(LCD_FUNCTIONSET | _lcd_displayfunction);
-    _delay_us(4500);  // wait more than 4.1ms
-
-    // second try
-    lcd_command(LCD_FUNCTIONSET | _lcd_displayfunction);
-    _delay_us(150);
+  // before sending commands. Arduino can turn on way before 4.5V so we'll wait 50.
+  // The waits are deadlines on the system tick, checked by lcd_init_step from the
+  // main loop, so nothing blocks while the display starts. Each wait runs from the
+  // tick its bytes reached the display on (each step drains the TWI queue before
+  // taking the time), since the main loop may reach a step late, and is one tick
+  // longer than the minimum because the first tick may be partial.
+  // After a warm restart the display is already powered, so there is no wait.
+  _lcd_init_warm = warm;
+  _lcd_init_state = LCD_INIT_POWER_UP;
+  _lcd_init_deadline = system_time() + (warm ? 0 : 51);
+}
 
-    // third go
-    lcd_command(LCD_FUNCTIONSET | _lcd_displayfunction);
+// Runs the next step of the startup sequence once its wait has passed
+void lcd_init_step(void){
+  if (_lcd_init_state == LCD_INIT_IDLE || _lcd_init_state == LCD_INIT_READY) {
+    return;
+  }
+  if ((int16_t)(system_time() - _lcd_init_deadline) < 0) {
+    return;
   }
 
-  // finally, set # lines, font size, etc.
-  lcd_command(LCD_FUNCTIONSET | _lcd_displayfunction);  
-
-  // turn the display on with no cursor or blinking default
-  _lcd_displaycontrol = LCD_DISPLAYON | LCD_CURSOROFF | LCD_BLINKOFF;  
-  lcd_display();
+  uint8_t wait = 0;
+  switch (_lcd_init_state) {
+    case LCD_INIT_POWER_UP:
+      //put the LCD into 4 bit or 8 bit mode
+      if (LCD_USING_4PIN_MODE) {
+        // this is according to the hitachi HD44780 datasheet
+        // figure 24, pg 46
+
+        // we start in 8bit mode, try to set 4 bit mode
+        lcd_write4bits(0b0011);
+      } else {
+        // this is according to the hitachi HD44780 datasheet
+        // page 45 figure 23
+
+        // Send function set command sequence
+        lcd_command(LCD_FUNCTIONSET | _lcd_displayfunction);
+      }
+      // wait min 4.1ms - or when warm, 1.52ms in case this nibble finished a half-sent clear/home
+      wait = _lcd_init_warm ? 3 : 5;
+      _lcd_init_state = LCD_INIT_RETRY;
+      break;
+
+    case LCD_INIT_RETRY:
+      // second try
+      if (LCD_USING_4PIN_MODE) {
+        lcd_write4bits(0b0011);
+      } else {
+        lcd_command(LCD_FUNCTIONSET | _lcd_displayfunction);
+      }
+      wait = _lcd_init_warm ? 2 : 5; // wait min 4.1ms (4pin) or 150us (8pin)
+      _lcd_init_state = LCD_INIT_THIRD;
+      break;
+
+    case LCD_INIT_THIRD:
+      // third go!
+      if (LCD_USING_4PIN_MODE) {
+        lcd_write4bits(0b0011); 
+        lcd_transport_drain();
+        _delay_us(150);
+
+        // finally, set to 4-bit interface
+        lcd_write4bits(0b0010); 
+      } else {
+        lcd_command(LCD_FUNCTIONSET | _lcd_displayfunction);
+      }
+      _lcd_init_state = LCD_INIT_CONFIGURE;
+      break;
+
+    case LCD_INIT_CONFIGURE:
+      // finally, set # lines, font size, etc.
+      lcd_command(LCD_FUNCTIONSET | _lcd_displayfunction);  
+
+      // turn the display on with no cursor or blinking default
+      _lcd_displaycontrol = LCD_DISPLAYON | LCD_CURSOROFF | LCD_BLINKOFF;  
+      lcd_display();
+
+      // clear it off - this command takes a long time, so wait for it here rather than in lcd_clear.
+      // A warm restart redraws every cell from the restored lines anyway, so skip it.
+      if (!_lcd_init_warm) {
+        lcd_command(LCD_CLEARDISPLAY);
+        wait = 3;
+      }
+      _lcd_init_state = LCD_INIT_ENTRY_MODE;
+      break;
+
+    case LCD_INIT_ENTRY_MODE:
+      // Initialize to default text direction (for romance languages)
+      _lcd_displaymode = LCD_ENTRYLEFT | LCD_ENTRYSHIFTDECREMENT;
+      // set the entry mode
+      lcd_command(LCD_ENTRYMODESET | _lcd_displaymode);
+      _lcd_init_state = LCD_INIT_READY;
+      break;
+  }
 
-  // clear it off
-  lcd_clear();
+  // send this step's bytes now (nothing to do for the GPIO transport), and start the wait once they're out
+  lcd_transport_drain();
+  if (wait) {
+    _lcd_init_deadline = system_time() + wait;
+  }
+}
 
-  // Initialize to default text direction (for romance languages)
-  _lcd_displaymode = LCD_ENTRYLEFT | LCD_ENTRYSHIFTDECREMENT;
-  // set the entry mode
-  lcd_command(LCD_ENTRYMODESET | _lcd_displaymode);
+bool lcd_is_ready(void){
+  return _lcd_init_state == LCD_INIT_READY;
 }
 
 /********** high level commands, for the user! */
@@ -677,20 +1458,24 @@ void lcd_write_string(uint8_t x, uint8_t y, char string[]){
   for(int i=0; string[i]!='\0'; ++i){
     lcd_write(string[i]);
   }
+  lcd_transport_flush();
 }
 
 void lcd_write_char(uint8_t x, uint8_t y, char val){
   lcd_setCursor(x,y);
   lcd_write(val);
+  lcd_transport_flush();
 }
 
 void lcd_clear(void){
   lcd_command(LCD_CLEARDISPLAY);  // clear display, set cursor position to zero
+  lcd_transport_drain();
   _delay_us(2000);  // this command takes a long time!
 }
 
 void lcd_home(void){
   lcd_command(LCD_RETURNHOME);  // set cursor position to zero
+  lcd_transport_drain();
   _delay_us(2000);  // this command takes a long time!
 }
 
@@ -702,6 +1487,7 @@ void lcd_createChar(uint8_t location, uint8_t charmap[]) {
   for (int i=0; i<8; i++) {
     lcd_write(charmap[i]);
   }
+  lcd_transport_flush();
 }
 
 void lcd_setCursor(uint8_t col, uint8_t row){
@@ -792,6 +1578,51 @@ inline size_t lcd_write(uint8_t value) {
 
 /************ low level data pushing commands **********/
 
+// The transport provides lcd_send and lcd_write4bits, plus:
+//   lcd_transport_init   set up the pins or bus
+//   lcd_transport_flush  start sending anything queued (returns straight away)
+//   lcd_transport_drain  wait until everything queued is on the display
+//   lcd_transport_failed true once after bytes were lost, so the display may be out of step
+// Bytes may be queued until the next flush - the high level functions flush when they finish.
+
+#if LCD_TRANSPORT == LCD_TRANSPORT_GPIO
+
+void lcd_transport_init(void) {
+  // RS Pin
+  LCD_RS_DDR |= (1 << LCD_RS_PIN);
+  // Enable Pin
+  LCD_ENABLE_DDR |= (1 << LCD_ENABLE_PIN);
+  
+  #if LCD_USING_4PIN_MODE
+    //Set DDR for all the data pins
+    LCD_DATA4_DDR |= (1 << LCD_DATA4_PIN);
+    LCD_DATA5_DDR |= (1 << LCD_DATA5_PIN);
+    LCD_DATA6_DDR |= (1 << LCD_DATA6_PIN);    
+    LCD_DATA7_DDR |= (1 << LCD_DATA7_PIN);
+
+  #else
+    //Set DDR for all the data pins
+    LCD_DATA0_DDR |= (1 << LCD_DATA0_PIN);
+    LCD_DATA1_DDR |= (1 << LCD_DATA1_PIN);
+    LCD_DATA2_DDR |= (1 << LCD_DATA2_PIN);
+    LCD_DATA3_DDR |= (1 << LCD_DATA3_PIN);
+    LCD_DATA4_DDR |= (1 << LCD_DATA4_PIN);
+    LCD_DATA5_DDR |= (1 << LCD_DATA5_PIN);
+    LCD_DATA6_DDR |= (1 << LCD_DATA6_PIN);
+    LCD_DATA7_DDR |= (1 << LCD_DATA7_PIN);
+  #endif 
+
+  // Now we pull both RS and Enable low to begin commands (R/W is wired to ground)
+  LCD_RS_PORT &= ~(1 << LCD_RS_PIN);
+  LCD_ENABLE_PORT &= ~(1 << LCD_ENABLE_PIN);
+}
+
+// every write is finished before it returns
+void lcd_transport_flush(void) {}
+void lcd_transport_drain(void) {}
+bool lcd_transport_busy(void) { return false; }
+bool lcd_transport_failed(void) { return false; }
+
 // write either command or data, with automatic 4/8-bit selection
 void lcd_send(uint8_t value, uint8_t mode) {
   //RS Pin
@@ -873,5 +1704,142 @@ void lcd_write8bits(uint8_t value) {
     LCD_DATA7_PORT |= ((value & 1) << LCD_DATA7_PIN);
     
     lcd_pulseEnable();
+  #else
+    (void)value;
   #endif
-}
\ No newline at end of file
+}
+
+#elif LCD_TRANSPORT == LCD_TRANSPORT_TWI
+
+void lcd_transport_init(void) {
+  // on a restart after an error, let the last STOP go out before taking the pins back
+  while (BIT_IS_SET(TWCR, TWSTO)) {
+    _delay_us(1);
+  }
+  TWCR = 0;
+
+  // a reset part way through a transfer can leave the expander holding SDA low -
+  // nine clocks on SCL let it finish the byte and release the bus
+  SET_BIT(DDRC, LCD_TWI_SCL_PIN);
+  for (int i = 0; i < 9; i++) {
+    CLEAR_BIT(PORTC, LCD_TWI_SCL_PIN);
+    _delay_us(5);
+    SET_BIT(PORTC, LCD_TWI_SCL_PIN);
+    _delay_us(5);
+  }
+  CLEAR_BIT(DDRC, LCD_TWI_SCL_PIN);
+
+  // bus clock with prescaler 1: F_CPU / (16 + 2 * TWBR)
+  TWSR = 0;
+  TWBR = (F_CPU / LCD_TWI_FREQ - 16) / 2;
+  TWCR = (1 << TWEN);
+
+  _lcd_twi_head = _lcd_twi_tail = 0;
+  _lcd_twi_active = false;
+  _lcd_twi_pins = LCD_PCF_POWER_ON;
+  _lcd_rs = 0;
+}
+
+void lcd_twi_queue(uint8_t pins) {
+  // add one expander byte, starting the bus early if the queue fills up
+  uint8_t next = (_lcd_twi_head + 1) & (LCD_TWI_QUEUE_SIZE - 1);
+  while (next == _lcd_twi_tail) {
+    lcd_transport_flush();
+    _delay_us(10);
+  }
+
+  _lcd_twi_queue[_lcd_twi_head] = pins;
+  _lcd_twi_head = next;
+  _lcd_twi_pins = pins;
+}
+
+void lcd_transport_flush(void) {
+  // start a transaction if one isn't running - the interrupt keeps it going until the queue is empty
+  uint8_t sreg = SREG;
+  cli();
+  if (!_lcd_twi_active && _lcd_twi_head != _lcd_twi_tail) {
+    // the last transaction's STOP may still be going out - wait for the hardware to clear TWSTO
+    // (as Arduino's Wire does) rather than write a START over it
+    while (BIT_IS_SET(TWCR, TWSTO)) {
+      _delay_us(1);
+    }
+    _lcd_twi_active = true;
+    TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+  }
+  SREG = sreg;
+}
+
+bool lcd_transport_busy(void) {
+  return _lcd_twi_active || _lcd_twi_head != _lcd_twi_tail;
+}
+
+void lcd_transport_drain(void) {
+  lcd_transport_flush();
+  while (lcd_transport_busy()) {
+    _delay_us(10);
+  }
+}
+
+bool lcd_transport_failed(void) {
+  // a transaction can end between the two nibbles of a byte, so losing the next one
+  // leaves the display reading every later byte half a byte out of step
+  uint8_t errors = _lcd_twi_errors;
+  bool failed = errors != _lcd_twi_errors_seen;
+  _lcd_twi_errors_seen = errors;
+  return failed;
+}
+
+// write either command or data - the register select travels with each nibble
+void lcd_send(uint8_t value, uint8_t mode) {
+  _lcd_rs = mode ? LCD_PCF_RS : 0;
+  lcd_write4bits(value>>4);
+  lcd_write4bits(value);
+}
+
+void lcd_write4bits(uint8_t value) {
+  // each nibble is an enable pulse encoded in the byte stream - at 100 kHz every byte
+  // takes 90us on the bus, which covers the pulse width and the 37us command time
+  uint8_t pins = (value << 4) | LCD_PCF_BACKLIGHT | _lcd_rs;
+
+  // finish a pulse left open (the expander powers up with every output high)
+  if (_lcd_twi_pins & LCD_PCF_ENABLE) lcd_twi_queue(_lcd_twi_pins & ~LCD_PCF_ENABLE);
+  // RS has to settle before enable rises
+  if ((_lcd_twi_pins ^ pins) & LCD_PCF_RS) lcd_twi_queue(pins);
+
+  lcd_twi_queue(pins | LCD_PCF_ENABLE);
+  lcd_twi_queue(pins);
+}
+
+ISR(TWI_vect) {
+  // send the queue in one transaction: START, address, every queued byte, STOP
+  switch (TW_STATUS) {
+    case TW_START:
+    case TW_REP_START:
+      TWDR = LCD_TWI_ADDRESS << 1;
+      TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+      break;
+
+    case TW_MT_SLA_ACK:
+    case TW_MT_DATA_ACK:
+      if (_lcd_twi_tail != _lcd_twi_head) {
+        TWDR = _lcd_twi_queue[_lcd_twi_tail];
+        _lcd_twi_tail = (_lcd_twi_tail + 1) & (LCD_TWI_QUEUE_SIZE - 1);
+        TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+      } else {
+        TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+        _lcd_twi_active = false;
+      }
+      break;
+
+    default:
+      // no answer or lost the bus - drop what's queued rather than hang the display,
+      // and process() starts the display again
+      _lcd_twi_errors++;
+      _lcd_twi_tail = _lcd_twi_head;
+      TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+      _lcd_twi_active = false;
+      break;
+  }
+}
+
+#endif
\ No newline at end of file
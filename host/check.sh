@@ -0,0 +1,83 @@
+#!/bin/sh
+# Builds the replay harness for each firmware build and runs every fixture in expected.txt against it,
+# plus a sweep of LCD start-ups over main loop timings, and the matrix keypad test (replay -m) on the matrix builds.
+# usage: host/check.sh [build ...]   (default: all of them)
+# Set CC to pick the compiler. Exits non-zero if any build fails, any run differs or any run loses ticks.
+
+cd "$(dirname "$0")" || exit 2
+CC=${CC:-cc}
+
+# build name and the flags that select it
+flags() {
+    case "$1" in
+        gpio) echo "" ;;
+        twi) echo "-DLCD_TRANSPORT=LCD_TRANSPORT_TWI" ;;
+        matrix) echo "-DKEYPAD_MODE=KEYPAD_MATRIX" ;;
+        matrix-slow) echo "-DKEYPAD_MODE=KEYPAD_MATRIX -DKEYPAD_SCAN_TICKS=4" ;;
+        *) return 1 ;;
+    esac
+}
+
+builds=${*:-gpio twi matrix matrix-slow}
+work=$(mktemp -d) || exit 2
+trap 'rm -rf "$work"' EXIT
+status=0
+
+for build in $builds; do
+    build_flags=$(flags "$build") || { echo "unknown build: $build"; exit 2; }
+    if ! $CC -O2 -Wall -Wextra -Werror $build_flags -o "$work/replay-$build" replay.c; then
+        echo "FAIL $build: build"
+        status=1
+        continue
+    fi
+
+    while read -r trace applies options digest; do
+        case "$trace" in ''|'#'*) continue ;; esac
+        case ",$applies," in *",all,"*|*",$build,"*) ;; *) continue ;; esac
+        [ "$options" = - ] && options=
+        options=$(echo "$options" | tr ',' ' ')
+
+        "$work/replay-$build" $options "traces/$trace.bin" > "$work/out" 2>&1
+        code=$?
+        got=$(sed -n 's/^digest: *//p' "$work/out")
+        # key handlers run from the main loop, so no build should hold up the tick
+        lost=$(sed -n 's/^system tick: *\([0-9]*\) ticks lost.*/\1/p' "$work/out")
+
+        if [ $code -ne 0 ] || [ "$got" != "$digest" ] || [ "${lost:-0}" -ne 0 ]; then
+            echo "FAIL $build $trace${options:+ $options}: exit $code, digest ${got:-none}, expected $digest, ${lost:-0} ticks lost"
+            sed 's/^/    /' "$work/out"
+            status=1
+        else
+            echo "ok   $build $trace${options:+ $options}"
+        fi
+    done < expected.txt
+
+    # the main loop runs each start-up step at a pseudo-random point in its tick (replay -p picks the
+    # sequence), so try the start-up over enough of them to land late in one tick and early in the next
+    failed=
+    for seed in $(seq 1 64); do
+        "$work/replay-$build" -p "$seed" traces/boot_keys.bin > "$work/out" 2>&1 || { failed=$seed; break; }
+    done
+    if [ -n "$failed" ]; then
+        echo "FAIL $build start-up -p $failed"
+        sed 's/^/    /' "$work/out"
+        status=1
+    else
+        echo "ok   $build start-up over 64 phase sequences"
+    fi
+
+    # keys held together can't be written as a trace, so the matrix builds test those themselves
+    case "$build" in
+        matrix*)
+            if "$work/replay-$build" -m > "$work/out" 2>&1; then
+                echo "ok   $build -m"
+            else
+                echo "FAIL $build -m"
+                sed 's/^/    /' "$work/out"
+                status=1
+            fi
+            ;;
+    esac
+done
+
+exit $status
@@ -0,0 +1,1066 @@
+// * HOST BUILD SHIM * //
+// Lets the safe logic in "Assignment 1.c" run on a linux host, under the HD44780 emulator and replay harness below.
+// Build with: gcc -O2 -o replay host/replay.c
+// (add -DLCD_TRANSPORT=LCD_TRANSPORT_TWI to run the I2C backpack against a simulated bus,
+// or -DKEYPAD_MODE=KEYPAD_MATRIX to scan the keypad matrix)
+// host/check.sh builds each of them and replays the fixtures in host/traces against host/expected.txt.
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef HOST_BUILD
+#define HOST_BUILD
+#endif
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+// registers are plain memory on the host
+volatile uint8_t DDRB, DDRC, DDRD;
+volatile uint8_t PORTB, PORTC, PORTD;
+volatile uint8_t PINB, PIND;
+volatile uint8_t PCICR, PCMSK0, PCMSK2;
+volatile uint8_t TIMSK0, TCCR0A, TCCR0B, TCNT0;
+volatile uint8_t TIMSK2, TCCR2A, TCCR2B, TCNT2, OCR2A, TIFR2;
+volatile uint8_t UBRR0H, UBRR0L, UCSR0B, UCSR0C, UDR0;
+volatile uint8_t UCSR0A = (1 << 5);
+volatile uint8_t SREG;
+volatile uint8_t MCUSR;
+volatile uint8_t TWBR, TWSR, TWCR, TWDR;
+
+// register bit positions (ATmega328P)
+#define UDRE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ00 1
+#define PCIE0 0
+#define PCIE2 2
+#define PCINT0 0
+#define PCINT1 1
+#define PCINT2 2
+#define PCINT3 3
+#define PCINT4 4
+#define PCINT5 5
+#define PCINT20 4
+#define PCINT21 5
+#define PCINT22 6
+#define PCINT23 7
+#define WGM21 1
+#define CS22 2
+#define OCIE2A 1
+#define OCF2A 1
+#define WDRF 3
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWEN 2
+#define TWIE 0
+
+// TWI status codes (util/twi.h)
+#define TW_STATUS (TWSR & 0xF8)
+#define TW_START 0x08
+#define TW_REP_START 0x10
+#define TW_MT_SLA_ACK 0x18
+#define TW_MT_SLA_NACK 0x20
+#define TW_MT_DATA_ACK 0x28
+#define TW_MT_DATA_NACK 0x30
+
+// interrupt vectors become ordinary functions the harness calls directly
+#define ISR(vector) void vector(void)
+// the global interrupt flag is SREG's I bit, so SREG = sreg puts it back as on the chip
+#define SREG_I 7
+void host_sei(void);
+#define sei() host_sei()
+#define cli() (SREG &= ~(1 << SREG_I))
+
+// flash and RAM share one address space on the host
+#define PROGMEM
+#define memcpy_P memcpy
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+
+// the harness decides when the watchdog fires
+#define WDTO_250MS 4
+#define wdt_enable(timeout) ((void)(timeout))
+#define wdt_reset() ((void)0)
+#define wdt_disable() ((void)0)
+
+// virtual time - busy-wait delays and UART output move it on, as well as the replay itself
+uint32_t host_now_us;
+uint32_t host_busy_us;
+uint32_t host_next_ms_us = 1000;
+
+// busy-wait delays take no real time, but let the HD44780 emulator see the LCD pins,
+// and the system ticks that fall due during them still run
+void host_delay_us(uint32_t us);
+void host_run_ticks(void);
+#define _delay_us(us) host_delay_us((uint32_t)(us))
+
+void host_uart_capture(unsigned char character);
+
+// * END HOST BUILD SHIM * //
+
+
+#include "../Assignment 1.c"
+
+
+// * HD44780 EMULATOR * //
+// Software model of the display for host builds. With the GPIO transport every enable pulse in the
+// driver is followed by a _delay_us, so the model samples the LCD pins on PORTC there. With the TWI
+// transport a simulated bus feeds each byte to a PCF8574 model driving the same pins. Either way
+// the model latches a nibble on each falling edge of enable, and decodes the bus into instructions
+// and data. It keeps DDRAM/CGRAM, counts bus traffic, and flags anything faster than the datasheet
+// minimums.
+
+// datasheet timings (HD44780U, 270 kHz oscillator)
+#define HD_POWER_UP_US 40000UL
+#define HD_EXEC_US 37
+#define HD_EXEC_LONG_US 1520
+#define HD_RESET_FIRST_US 4100
+#define HD_RESET_SECOND_US 100
+#define HD_MAX_REPORTED 10
+
+// instruction kinds, for counting traffic per operation
+#define HD_OP_CLEAR 0
+#define HD_OP_HOME 1
+#define HD_OP_ENTRY 2
+#define HD_OP_CONTROL 3
+#define HD_OP_SHIFT 4
+#define HD_OP_FUNCTION 5
+#define HD_OP_CGRAM_ADDR 6
+#define HD_OP_DDRAM_ADDR 7
+#define HD_OP_DATA 8
+#define HD_OP_COUNT 9
+
+const char *hd_op_names[HD_OP_COUNT] = {
+    "clear", "home", "entry mode", "display control", "shift",
+    "function set", "cgram address", "ddram address", "data"
+};
+
+typedef struct {
+    // controller memory and registers
+    uint8_t ddram[0x80];
+    uint8_t cgram[0x40];
+    uint8_t address;
+    bool cgram_selected;
+    uint8_t entry_mode;
+    uint8_t display_control;
+    uint8_t function;
+    bool four_bit;
+    bool nibble_pending;
+    uint8_t high_nibble;
+    uint8_t resets;
+
+    // bus state
+    bool started;
+    bool enable;
+    bool rs_at_rise;
+    uint32_t rise_us;
+    uint32_t busy_until_us;
+
+    // statistics
+    unsigned long strobes;
+    unsigned long ops[HD_OP_COUNT];
+    unsigned long violations;
+} hd44780;
+
+hd44780 hd = { .entry_mode = LCD_ENTRYLEFT };
+bool hd_dump;
+
+uint32_t hd_time_us(void) {
+    return host_now_us;
+}
+
+void hd_violation(uint32_t now, const char *what, unsigned value) {
+    // count every violation, but only print the first few
+    if (hd.violations++ < HD_MAX_REPORTED) {
+        fprintf(stderr, "hd44780: [%lu us] %s (%u)\n", (unsigned long)now, what, value);
+    }
+}
+
+void hd_next_address(void) {
+    // move the address counter as set by the entry mode, wrapping like a 2-line display
+    bool increment = hd.entry_mode & LCD_ENTRYLEFT;
+
+    if (hd.cgram_selected) {
+        hd.address = (hd.address + (increment ? 1 : -1)) & 0x3F;
+    } else if (increment) {
+        hd.address = (hd.address == 0x27) ? 0x40 : (hd.address == 0x67) ? 0x00 : hd.address + 1;
+    } else {
+        hd.address = (hd.address == 0x40) ? 0x27 : (hd.address == 0x00) ? 0x67 : hd.address - 1;
+    }
+}
+
+void hd_execute(uint8_t value, bool rs, uint32_t now) {
+    // run one complete instruction or data write
+    uint32_t exec_us = HD_EXEC_US;
+    int op;
+
+    if (rs) {
+        op = HD_OP_DATA;
+        if (hd.cgram_selected) {
+            hd.cgram[hd.address & 0x3F] = value;
+        } else {
+            hd.ddram[hd.address & 0x7F] = value;
+        }
+        hd_next_address();
+    } else if (value & LCD_SETDDRAMADDR) {
+        op = HD_OP_DDRAM_ADDR;
+        hd.address = value & 0x7F;
+        hd.cgram_selected = false;
+    } else if (value & LCD_SETCGRAMADDR) {
+        op = HD_OP_CGRAM_ADDR;
+        hd.address = value & 0x3F;
+        hd.cgram_selected = true;
+    } else if (value & LCD_FUNCTIONSET) {
+        op = HD_OP_FUNCTION;
+
+        // the first three 8-bit function sets are the reset sequence, with longer waits
+        if (!hd.four_bit && (value & LCD_8BITMODE)) {
+            hd.resets++;
+            if (hd.resets == 1) exec_us = HD_RESET_FIRST_US;
+            if (hd.resets == 2) exec_us = HD_RESET_SECOND_US;
+        }
+        if (!hd.four_bit && !(value & LCD_8BITMODE) && hd.resets < 3) {
+            hd_violation(now, "4-bit mode set before the 3-step reset sequence, resets seen", hd.resets);
+        }
+
+        hd.four_bit = !(value & LCD_8BITMODE);
+        hd.function = value;
+    } else if (value & LCD_CURSORSHIFT) {
+        op = HD_OP_SHIFT;
+        if (!(value & LCD_DISPLAYMOVE)) {
+            if (value & LCD_MOVERIGHT) {
+                hd_next_address();
+            } else {
+                hd.address = (hd.address - 1) & 0x7F;
+            }
+        }
+    } else if (value & LCD_DISPLAYCONTROL) {
+        op = HD_OP_CONTROL;
+        hd.display_control = value;
+    } else if (value & LCD_ENTRYMODESET) {
+        op = HD_OP_ENTRY;
+        hd.entry_mode = value;
+    } else if (value & LCD_RETURNHOME) {
+        op = HD_OP_HOME;
+        hd.address = 0;
+        hd.cgram_selected = false;
+        exec_us = HD_EXEC_LONG_US;
+    } else if (value & LCD_CLEARDISPLAY) {
+        op = HD_OP_CLEAR;
+        memset(hd.ddram, ' ', sizeof(hd.ddram));
+        hd.address = 0;
+        hd.cgram_selected = false;
+        hd.entry_mode |= LCD_ENTRYLEFT;
+        exec_us = HD_EXEC_LONG_US;
+    } else {
+        hd_violation(now, "undefined instruction", value);
+        return;
+    }
+
+    hd.ops[op]++;
+    hd.busy_until_us = now + exec_us;
+
+    if (hd_dump) {
+        printf("[%10lu us] %-15s 0x%02x", (unsigned long)now, hd_op_names[op], value);
+        if (rs && value >= ' ' && value < 0x7F) printf(" '%c'", value);
+        printf("\n");
+    }
+}
+
+void hd_strobe(uint8_t nibble, bool rs, uint32_t now) {
+    // latch one nibble on the falling edge of enable
+    hd.strobes++;
+
+    if (!hd.started) {
+        hd.started = true;
+        if (now < HD_POWER_UP_US) hd_violation(now, "first command before the power-up wait, us", now);
+    }
+
+    if (now < hd.busy_until_us) {
+        hd_violation(now, "write while busy, us early", hd.busy_until_us - now);
+    }
+
+    // 8-bit mode only has D7-D4 wired, so each strobe is a whole instruction
+    if (!hd.four_bit) {
+        hd_execute(nibble << 4, rs, now);
+        return;
+    }
+
+    if (!hd.nibble_pending) {
+        hd.high_nibble = nibble;
+        hd.nibble_pending = true;
+    } else {
+        hd.nibble_pending = false;
+        hd_execute((hd.high_nibble << 4) | nibble, rs, now);
+    }
+}
+
+void hd_pins(bool enable, bool rs, uint8_t nibble, uint32_t now) {
+    // act on any change of the enable line since the pins were last seen
+    if (enable && !hd.enable) {
+        hd.rise_us = now;
+        hd.rs_at_rise = rs;
+    } else if (!enable && hd.enable) {
+        if (now == hd.rise_us) hd_violation(now, "enable pulse shorter than 450 ns", 0);
+        if (rs != hd.rs_at_rise) hd_violation(now, "RS changed while enable was high", rs);
+
+        hd_strobe(nibble, rs, now);
+    }
+
+    hd.enable = enable;
+}
+
+#if LCD_TRANSPORT == LCD_TRANSPORT_GPIO
+
+void hd_sample(void) {
+    // read the LCD pins straight off PORTC
+    uint8_t nibble = BIT_VALUE(LCD_DATA4_PORT, LCD_DATA4_PIN)
+        | BIT_VALUE(LCD_DATA5_PORT, LCD_DATA5_PIN) << 1
+        | BIT_VALUE(LCD_DATA6_PORT, LCD_DATA6_PIN) << 2
+        | BIT_VALUE(LCD_DATA7_PORT, LCD_DATA7_PIN) << 3;
+
+    hd_pins(BIT_IS_SET(LCD_ENABLE_PORT, LCD_ENABLE_PIN), BIT_IS_SET(LCD_RS_PORT, LCD_RS_PIN), nibble, hd_time_us());
+}
+
+void host_twi_service(void) {}
+
+#elif LCD_TRANSPORT == LCD_TRANSPORT_TWI
+
+// simulated TWI bus with a PCF8574 slave - each operation takes its real bus time, and the
+// firmware's interrupt runs when it finishes
+#define HOST_TWI_BYTE_US (9 * 1000000UL / LCD_TWI_FREQ)
+#define HOST_TWI_START_US (HOST_TWI_BYTE_US / 9)
+
+typedef struct {
+    uint32_t clock_us;      // when the bus finished its last operation
+    uint32_t seen_us;       // when the firmware was last checked for a new request
+    bool idle;              // nothing was requested at the last check
+    bool stopping;          // a STOP was requested and TWSTO is still set
+    bool in_transaction;
+    bool addressed;         // the expander answered the last address byte
+    uint8_t pins;           // the expander's output latch
+    uint8_t sent;           // data bytes acknowledged in this transaction
+    unsigned long transactions;
+    unsigned long bytes;
+} host_twi_bus;
+
+host_twi_bus host_twi = { .idle = true, .pins = LCD_PCF_POWER_ON };
+
+// with -e N the expander stops answering part way through every Nth transaction, as if the bus
+// had a glitch - after an odd number of bytes, so the display sees half of a nibble pulse
+unsigned long host_twi_fail_every;
+#define HOST_TWI_FAIL_AFTER 5
+
+void hd_sample(void) {
+    // the expander drives the LCD pins
+    hd_pins(host_twi.pins & LCD_PCF_ENABLE, host_twi.pins & LCD_PCF_RS, host_twi.pins >> 4, hd_time_us());
+}
+
+void host_twi_service(void) {
+    // carry out every requested operation that has finished by now
+    uint32_t now = hd_time_us();
+    bool requested = BIT_IS_SET(TWCR, TWINT) && BIT_IS_SET(TWCR, TWEN);
+
+    // an idle bus starts on a new request from the time it was made
+    if (host_twi.idle && requested && host_twi.clock_us < host_twi.seen_us) host_twi.clock_us = host_twi.seen_us;
+
+    while (BIT_IS_SET(TWCR, TWINT) && BIT_IS_SET(TWCR, TWEN)) {
+        uint8_t control = TWCR;
+
+        if (host_twi.stopping && !(control & (1 << TWSTO))) {
+            // the firmware rewrote TWCR before the hardware had cleared TWSTO - on the chip the STOP
+            // and the new request collide, so the model reports it rather than guess what happens
+            hd_violation(now, "TWCR written while a STOP was still pending, TWCR", control);
+            host_twi.stopping = false;
+            host_twi.in_transaction = false;
+        }
+
+        // START and STOP each take about a bit time, an address or data byte nine
+        uint32_t duration = (control & ((1 << TWSTA) | (1 << TWSTO))) ? HOST_TWI_START_US : HOST_TWI_BYTE_US;
+        if (host_twi.clock_us + duration > now) {
+            // TWSTO stays set until the STOP is on the bus
+            host_twi.stopping = (control & (1 << TWSTO)) != 0;
+            break;
+        }
+        host_twi.clock_us += duration;
+
+        if (control & (1 << TWSTO)) {
+            // STOP (and START after it, if also asked for) - STOP raises no interrupt
+            host_twi.stopping = false;
+            host_twi.in_transaction = false;
+            TWCR = control & ~((1 << TWSTO) | (1 << TWINT));
+            if (control & (1 << TWSTA)) TWCR |= (1 << TWINT);
+            continue;
+        }
+
+        if (control & (1 << TWSTA)) {
+            TWSR = host_twi.in_transaction ? TW_REP_START : TW_START;
+            host_twi.in_transaction = true;
+            host_twi.addressed = false;
+            host_twi.sent = 0;
+            host_twi.transactions++;
+        } else if (TWSR == TW_START || TWSR == TW_REP_START) {
+            // address byte - the expander only answers a write to its own address
+            host_twi.addressed = (TWDR == (LCD_TWI_ADDRESS << 1));
+            TWSR = host_twi.addressed ? TW_MT_SLA_ACK : TW_MT_SLA_NACK;
+        } else if (host_twi.addressed && host_twi_fail_every && host_twi.sent == HOST_TWI_FAIL_AFTER
+                   && host_twi.transactions % host_twi_fail_every == 0) {
+            host_twi.addressed = false;
+            TWSR = TW_MT_DATA_NACK;
+        } else if (host_twi.addressed) {
+            // data byte - the expander's outputs change as it acknowledges
+            host_twi.pins = TWDR;
+            host_twi.bytes++;
+            host_twi.sent++;
+            hd_pins(host_twi.pins & LCD_PCF_ENABLE, host_twi.pins & LCD_PCF_RS, host_twi.pins >> 4, host_twi.clock_us);
+            TWSR = TW_MT_DATA_ACK;
+        } else {
+            TWSR = TW_MT_DATA_NACK;
+        }
+
+        // hardware raises TWINT - here that means the request is done and the interrupt runs
+        TWCR = control & ~((1 << TWINT) | (1 << TWSTA));
+        if (control & (1 << TWIE)) TWI_vect();
+    }
+
+    host_twi.idle = !(BIT_IS_SET(TWCR, TWINT) && BIT_IS_SET(TWCR, TWEN));
+    host_twi.seen_us = now;
+}
+
+#endif
+
+void host_delay_us(uint32_t us) {
+    // pins are sampled at the start of the wait, then the wait is added to virtual time
+    hd_sample();
+    host_now_us += us;
+    host_busy_us += us;
+    host_twi_service();
+    host_run_ticks();
+}
+
+bool hd_line_matches(uint8_t row, const char line[]) {
+    // compare one visible row of DDRAM with a display line
+    return memcmp(&hd.ddram[row * 0x40], line, SCREEN_WIDTH) == 0;
+}
+
+unsigned long hd_instructions(void) {
+    unsigned long total = 0;
+    for (int op = 0; op < HD_OP_DATA; op++) total += hd.ops[op];
+    return total;
+}
+
+// * END HD44780 EMULATOR * //
+
+
+// * HOST REPLAY HARNESS * //
+// Replays a key trace captured over UART (see TRACE_CAPTURE) against key_event/process in virtual time.
+// usage: replay [-v] [-d] [-w record] [-p seed] [-e transactions] [-n repeats] trace_file
+//        replay -b
+//        replay -m
+// Any non-trace bytes in the file are treated as the unit's UART output and compared with the replay.
+// After every main loop pass the emulated DDRAM is checked against the display lines.
+// -v prints each change of safe state, -d dumps the decoded LCD bus,
+// -w N fires the watchdog just before record N to exercise the warm restart.
+// -p N seeds the points within the tick where main loop passes run (see host_step_ms).
+// -e N has the TWI expander ignore every Nth transaction, to exercise recovering the display.
+// -b times codes_match against attempts that are wrong at each digit in turn, instead of replaying -
+// in host nanoseconds, so it shows the shape of the profile but says nothing of AVR cycles.
+// Built with -DKEYPAD_MODE=1 every key is pressed and released on a simulated matrix for the scanner to find,
+// and -m runs the matrix test instead, holding keys together as a one-key-at-a-time trace can't.
+
+// a character at 9600 baud, 8N1
+#define HOST_UART_CHAR_US (10 * 1000000UL / BAUD)
+
+// replay state
+unsigned char *host_expected;
+size_t host_expected_len;
+size_t host_uart_len;
+char host_uart_tail[8];
+long host_mismatch = -1;
+bool host_checking;
+uint32_t host_digest = 2166136261UL;
+
+// lcd traffic per main loop pass
+unsigned long host_passes;
+unsigned long host_pass_strobes_max;
+unsigned long host_lcd_mismatches;
+
+// keys held down on the simulated matrix, and how long each press and release lasts - long enough
+// for the debounce to see it in every remembered scan, plus a scan for the first one to be partial
+// and another for margin
+uint16_t host_matrix_down;
+#define HOST_KEY_HOLD_MS ((KEYPAD_DEBOUNCE_SCANS + 2) * KEYPAD_ROWS * KEYPAD_SCAN_TICKS)
+
+void host_digest_byte(uint8_t byte) {
+    // FNV-1a over everything the firmware outputs
+    host_digest = (host_digest ^ byte) * 16777619UL;
+}
+
+void host_uart_capture(unsigned char character) {
+    // compare against the captured UART text while the first pass runs
+    if (host_checking && host_mismatch < 0) {
+        if (host_uart_len >= host_expected_len || host_expected[host_uart_len] != character) {
+            host_mismatch = (long)host_uart_len;
+        }
+    }
+
+    host_uart_len++;
+    host_digest_byte(character);
+    memmove(host_uart_tail, host_uart_tail + 1, sizeof(host_uart_tail) - 1);
+    host_uart_tail[sizeof(host_uart_tail) - 1] = character;
+
+    // uart_printchar waits for each character to go out
+    host_delay_us(HOST_UART_CHAR_US);
+}
+
+typedef struct {
+    bool locked;
+    bool unlocked;
+    bool disabled;
+    int unlock_attempts;
+} host_state;
+
+host_state host_snapshot(void) {
+    host_state state = { locked, unlocked, disabled, unlock_attempts };
+    return state;
+}
+
+bool host_state_changed(host_state a, host_state b) {
+    return a.locked != b.locked || a.unlocked != b.unlocked
+        || a.disabled != b.disabled || a.unlock_attempts != b.unlock_attempts;
+}
+
+void host_process(void) {
+    // one main loop pass, then check what reached the display
+    unsigned long strobes = hd.strobes;
+    uint8_t errors = _lcd_twi_errors;
+    process();
+
+    // let a queued transport finish sending before looking at the display - unless this pass
+    // lost bytes, when the next one is meant to start it again and redraw it
+    while (lcd_transport_busy()) host_delay_us(10);
+    if (!lcd_is_ready() || _lcd_twi_errors != errors) return;
+
+    host_passes++;
+    strobes = hd.strobes - strobes;
+    if (strobes > host_pass_strobes_max) host_pass_strobes_max = strobes;
+
+    if (!hd_line_matches(0, display_line1) || !hd_line_matches(1, display_line2)) {
+        if (host_lcd_mismatches++ < HD_MAX_REPORTED) {
+            fprintf(stderr, "lcd: [%lu us] ddram |%.16s| |%.16s| expected |%.16s| |%.16s|\n",
+                (unsigned long)hd_time_us(), &hd.ddram[0], &hd.ddram[0x40], display_line1, display_line2);
+        }
+    }
+}
+
+void host_matrix_pins(void) {
+    // columns idle high through their pull-ups, and go low wherever a chain of pressed keys
+    // joins them to a row driven low - which is how ghost keys appear on a matrix with no diodes
+    uint8_t rows = ((DDRD & ~PORTD) >> KEYPAD_ROW_PIN) & 0x0F;
+    uint8_t columns = 0, last_rows, last_columns;
+    do {
+        last_rows = rows;
+        last_columns = columns;
+        for (int row = 0; row < KEYPAD_ROWS; row++) {
+            uint8_t keys = (host_matrix_down >> (row * 4)) & KEYPAD_COLUMN_MASK;
+            if (BIT_IS_SET(rows, row)) columns |= keys;
+            if (keys & columns) SET_BIT(rows, row);
+        }
+    } while (rows != last_rows || columns != last_columns);
+
+    PINB = (PINB & ~KEYPAD_COLUMN_MASK) | (~columns & KEYPAD_COLUMN_MASK);
+}
+
+// interrupts - the firmware's interrupts don't nest, so a system tick that falls due while one
+// runs (or while the main loop has them off) waits for it to return, and any more than one are lost
+bool host_in_interrupt;
+unsigned long host_ticks_lost;
+
+// when timer0 next overflows
+uint32_t host_next_tick_us = TRACE_TICK_US;
+
+// where in the tick the main loop passes run - a fixed xorshift sequence, so runs repeat exactly
+uint32_t host_phase_seed = 1;
+
+void host_system_tick(void);
+
+void host_interrupt_return(void) {
+    host_in_interrupt = false;
+    if (host_next_ms_us > host_now_us) return;
+
+    while (host_next_ms_us + 1000 <= host_now_us) {
+        host_next_ms_us += 1000;
+        host_ticks_lost++;
+    }
+    host_next_ms_us += 1000;
+    host_system_tick();
+}
+
+void host_sei(void) {
+    // a tick held off by cli() runs as soon as interrupts are back on
+    SREG |= (1 << SREG_I);
+    if (!host_in_interrupt) host_interrupt_return();
+}
+
+void host_system_tick(void) {
+    // timer2 compare match, with timer2 counting on from zero
+    TCNT2 = 0;
+    #if KEYPAD_MODE == KEYPAD_MATRIX
+    host_matrix_pins();
+    #endif
+    if (!BIT_IS_SET(TIMSK2, OCIE2A)) return;
+
+    host_in_interrupt = true;
+    TIMER2_COMPA_vect();
+    host_interrupt_return();
+}
+
+void host_run_ticks(void) {
+    // run the system ticks that fell due during a busy wait, and keep timer2's count current
+    if (!host_in_interrupt && BIT_IS_SET(SREG, SREG_I)) {
+        while (host_next_ms_us <= host_now_us) {
+            host_next_ms_us += 1000;
+            host_system_tick();
+        }
+    }
+    uint32_t count = (host_now_us + 1000 - host_next_ms_us) / TICK_COUNT_US;
+    TCNT2 = count > TICK_TOP ? TICK_TOP : count;
+}
+
+void host_step_ms(void) {
+    // run on to the next 1 ms system tick
+    if (host_now_us < host_next_ms_us) host_now_us = host_next_ms_us;
+    host_next_ms_us += 1000;
+    host_system_tick();
+    host_twi_service();
+
+    // the background lcd start-up needs a main loop pass on every system tick,
+    // and matrix presses wait for one
+    if (!lcd_is_ready() || keypad_events_head != keypad_events_tail) {
+        // a real main loop gets there anywhere within the tick, so a wait timed from the tick
+        // can start late in one and end early in another
+        host_phase_seed ^= host_phase_seed << 13;
+        host_phase_seed ^= host_phase_seed >> 17;
+        host_phase_seed ^= host_phase_seed << 5;
+        uint32_t at = host_next_ms_us - 1000 + host_phase_seed % 1000;
+        if (host_now_us < at) host_now_us = at;
+        host_twi_service();
+        host_run_ticks();
+        host_process();
+    }
+}
+
+uint16_t host_matrix_bit(uint8_t key) {
+    // where a key code sits on the matrix, or 0 if this keypad doesn't have it
+    for (int position = 0; position < KEYPAD_KEYS; position++) {
+        if (keypad_map[position] == key && (position % 4) < KEYPAD_COLUMNS) return (uint16_t)1 << position;
+    }
+    return 0;
+}
+
+void host_run_ms(int ms) {
+    while (ms-- > 0) host_step_ms();
+}
+
+void host_key(uint8_t key) {
+    #if KEYPAD_MODE == KEYPAD_MATRIX
+    // hold the key long enough to get through the debounce, then let it go again
+    uint16_t bit = host_matrix_bit(key);
+    if (bit == 0) {
+        fprintf(stderr, "note: key %u is not on a %dx%d keypad\n", key, KEYPAD_ROWS, KEYPAD_COLUMNS);
+        return;
+    }
+
+    host_matrix_down |= bit;
+    host_run_ms(HOST_KEY_HOLD_MS);
+    host_matrix_down &= ~bit;
+    host_run_ms(HOST_KEY_HOLD_MS);
+    #else
+    // as if from the button's pin change interrupt, which queues the press for the main loop
+    host_in_interrupt = true;
+    keypad_queue(key, system_ms);
+    host_interrupt_return();
+    #endif
+}
+
+void host_watchdog_reset(void) {
+    // the worst time for it - the LCD has the first half of a clear, so the warm start's first
+    // nibble completes a return home and the next must wait out its 1.52 ms
+    // (sent once the instruction before it finished, as the firmware would have)
+    uint32_t sent = hd_time_us();
+    if (sent < hd.busy_until_us) sent = hd.busy_until_us;
+    hd_strobe(LCD_CLEARDISPLAY >> 4, false, sent);
+
+    // a watchdog reset clears RAM (except .noinit) and the I/O registers, but the LCD stays powered
+    code_salt = code_digest = 0;
+    entry_hash = HASH_START;
+    digits_pressed = 0;
+    locked = unlocked = disabled = false;
+    unlock_attempts = 3;
+    timer_overflow = 0;
+    trace_ticks = 0;
+    system_ms = 0;
+    pending_key_count = pending_key_replayed = 0;
+    watchdog_checkins = 0;
+    led_pattern = NULL;
+    led_index = led_red_level = led_green_level = led_phase = 0;
+    led_step_ticks = 0;
+    keypad_row = keypad_divider = 0;
+    keypad_raw = keypad_state = 0;
+    memset(keypad_history, 0, sizeof(keypad_history));
+    memset(keypad_seen_ms, 0, sizeof(keypad_seen_ms));
+    memset(&keypad_stats, 0, sizeof(keypad_stats));
+    keypad_events_head = keypad_events_tail = 0;
+    boot_input_ready_us = boot_lcd_ready_us = 0;
+    memset(display_line1, 0, sizeof(display_line1));
+    memset(display_line2, 0, sizeof(display_line2));
+    _lcd_displayfunction = _lcd_displaycontrol = _lcd_displaymode = 0;
+    _lcd_init_state = LCD_INIT_IDLE;
+    _lcd_init_deadline = 0;
+    _lcd_init_warm = false;
+
+    DDRB = DDRC = DDRD = PORTB = PORTC = PORTD = 0;
+    PCICR = PCMSK0 = PCMSK2 = 0;
+    TIMSK0 = TCCR0A = TCCR0B = TCNT0 = 0;
+    TIMSK2 = TCCR2A = TCCR2B = TCNT2 = OCR2A = TIFR2 = 0;
+    TWBR = TWSR = TWCR = TWDR = 0;
+    SREG = 0;
+    _lcd_rs = _lcd_twi_pins = 0;
+    _lcd_twi_head = _lcd_twi_tail = _lcd_twi_errors = _lcd_twi_errors_seen = 0;
+    _lcd_twi_active = false;
+    #if LCD_TRANSPORT == LCD_TRANSPORT_TWI
+    host_twi.stopping = host_twi.in_transaction = false;
+    #endif
+    hd_sample();
+
+    reset_flags = (1 << WDRF);
+    host_next_ms_us = host_now_us + 1000;
+    host_next_tick_us = host_now_us + TRACE_TICK_US;
+    master_setup();
+}
+
+void host_tick(void) {
+    // one timer0 overflow, with the 1 ms system ticks that fall inside it. Timer0 keeps its own
+    // schedule - a main loop pass that runs on past an overflow doesn't push the next one back
+    uint32_t end = host_next_tick_us;
+    host_next_tick_us += TRACE_TICK_US;
+    while (host_next_ms_us <= end) host_step_ms();
+    if (host_now_us < end) host_now_us = end;
+
+    // outside a lockout a main loop pass only redraws the same screen,
+    // so the countdown is the only thing that needs a pass on every tick
+    TCNT0 = 0;
+    host_in_interrupt = true;
+    TIMER0_OVF_vect();
+    host_interrupt_return();
+    if (disabled) host_process();
+}
+
+double host_wall_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void host_benchmark(void) {
+    // the host clock stands in for a cycle counter here, so the numbers only mean anything
+    // relative to each other - the profile across mismatch positions should be flat
+    static const int attempts[5][4] = { {1, 2, 3, 4}, {9, 2, 3, 4}, {1, 9, 3, 4}, {1, 2, 9, 4}, {1, 2, 3, 9} };
+    const long iterations = 10000;
+    double best[5];
+    bool matched[5];
+
+    digits_pressed = 0;
+    for (int i = 0; i < 4; i++) code_add(i + 1);
+
+    // interleave the rounds and keep the fastest, to take out scheduling noise
+    for (int round = 0; round < 200; round++) {
+        for (int a = 0; a < 5; a++) {
+            digits_pressed = 0;
+            for (int i = 0; i < 4; i++) try_code_add(attempts[a][i]);
+            volatile uint32_t attempt_hash = entry_hash;
+
+            double start = host_wall_seconds();
+            for (long n = 0; n < iterations; n++) {
+                entry_hash = attempt_hash;
+                matched[a] = codes_match();
+            }
+            double ns = (host_wall_seconds() - start) / iterations * 1e9;
+            if (round == 0 || ns < best[a]) best[a] = ns;
+        }
+    }
+
+    double low = best[0], high = best[0];
+    for (int a = 0; a < 5; a++) {
+        if (best[a] < low) low = best[a];
+        if (best[a] > high) high = best[a];
+        if (a == 0) {
+            printf("code 1234, attempt %d%d%d%d: %6.2f ns  %s\n", attempts[a][0], attempts[a][1],
+                attempts[a][2], attempts[a][3], best[a], matched[a] ? "match" : "NO MATCH");
+        } else {
+            printf("wrong digit %d, attempt %d%d%d%d: %6.2f ns  %s\n", a, attempts[a][0], attempts[a][1],
+                attempts[a][2], attempts[a][3], best[a], matched[a] ? "MATCH" : "no match");
+        }
+    }
+    printf("spread:       %.1f%% across mismatch positions\n", low > 0 ? (high - low) / low * 100 : 0.0);
+    printf("avr cycles:   not measured - hash_finish's hand count estimates under 600 (38 us at 16 MHz)\n");
+}
+
+bool host_uart_ends_with(const char text[]) {
+    size_t length = strlen(text);
+    return memcmp(host_uart_tail + sizeof(host_uart_tail) - length, text, length) == 0;
+}
+
+int host_check(bool passed, const char what[]) {
+    printf("%s %s\n", passed ? "ok  " : "FAIL", what);
+    return passed ? 0 : 1;
+}
+
+int host_matrix_test(void) {
+    // n-key rollover and ghosting on the simulated matrix, starting from a cold boot in code entry
+    #if KEYPAD_MODE == KEYPAD_MATRIX
+    int failures = 0;
+    master_setup();
+    for (int t = 0; t < 16 && !lcd_is_ready(); t++) host_tick();
+
+    // 1, 5 and 9 share no row or column, so each one added while the others are held is its own press
+    host_matrix_down = host_matrix_bit(1);
+    host_run_ms(HOST_KEY_HOLD_MS);
+    host_matrix_down |= host_matrix_bit(5);
+    host_run_ms(HOST_KEY_HOLD_MS);
+    host_matrix_down |= host_matrix_bit(9);
+    host_run_ms(HOST_KEY_HOLD_MS);
+    host_matrix_down = 0;
+    host_run_ms(HOST_KEY_HOLD_MS);
+    failures += host_check(keypad_stats.presses == 3 && digits_pressed == 3 && host_uart_ends_with("159"),
+        "rollover: 1, then 5, then 9 held together enter 159");
+
+    host_key(KEY_STAR);
+    failures += host_check(digits_pressed == 0, "* clears the digits entered");
+
+    // with 1 and 2 held, 4 closes three corners of a rectangle and 5 (never pressed) reads as down too -
+    // the scanner has to hold the state it had, rather than enter 4 or 5
+    uint16_t presses = keypad_stats.presses;
+    host_matrix_down = host_matrix_bit(1) | host_matrix_bit(2);
+    host_run_ms(HOST_KEY_HOLD_MS);
+    host_matrix_down |= host_matrix_bit(4);
+    host_run_ms(HOST_KEY_HOLD_MS);
+    failures += host_check(keypad_stats.ghosted > 0, "ghosting: 1, 2 and 4 held together are seen as ambiguous");
+    host_matrix_down = 0;
+    host_run_ms(HOST_KEY_HOLD_MS);
+    failures += host_check(keypad_stats.presses == presses + 2 && digits_pressed == 2 && host_uart_ends_with("12"),
+        "ghosting: only 1 and 2 are entered, not 4 or the ghost 5");
+    host_key(KEY_STAR);
+
+    // the # report prints for about 100 ms, which the system tick (and so the scan) must not wait on
+    unsigned long lost = host_ticks_lost;
+    host_key(KEY_HASH);
+    host_run_ms(1000);
+    failures += host_check(host_ticks_lost == lost && keypad_stats.scan_rate >= 1000 / (KEYPAD_ROWS * KEYPAD_SCAN_TICKS) - 1,
+        "# report: the scan keeps its rate while the report prints");
+
+    failures += host_check(hd.violations == 0 && host_lcd_mismatches == 0, "lcd: no timing/protocol violations or mismatches");
+    printf("keypad:       %u presses, latency %u-%u ms, %u ghosted scans, %lu ticks lost\n",
+        keypad_stats.presses, keypad_stats.latency_min, keypad_stats.latency_max, keypad_stats.ghosted, host_ticks_lost);
+    return failures ? 1 : 0;
+    #else
+    fprintf(stderr, "-m needs a matrix build (-DKEYPAD_MODE=KEYPAD_MATRIX)\n");
+    return 2;
+    #endif
+}
+
+int main(int argc, char *argv[]) {
+    bool verbose = false;
+    long repeats = 1;
+    long watchdog_at = -1;
+    char *path = NULL;
+
+    // parse arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            hd_dump = true;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            host_benchmark();
+            return 0;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            return host_matrix_test();
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            watchdog_at = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            host_phase_seed = strtoul(argv[++i], NULL, 0);
+            if (host_phase_seed == 0) host_phase_seed = 1;
+        #if LCD_TRANSPORT == LCD_TRANSPORT_TWI
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            host_twi_fail_every = strtoul(argv[++i], NULL, 0);
+        #endif
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            repeats = atol(argv[++i]);
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (path == NULL || repeats < 1) {
+        fprintf(stderr, "usage: %s [-v] [-d] [-w record] [-p seed] [-e transactions] [-n repeats] trace_file\n       %s -b\n       %s -m\n",
+            argv[0], argv[0], argv[0]);
+        return 2;
+    }
+
+    // read the whole capture
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 2;
+    }
+
+    size_t capacity = 4096, length = 0;
+    unsigned char *capture = malloc(capacity);
+    int byte;
+    while ((byte = fgetc(file)) != EOF) {
+        if (length == capacity) capture = realloc(capture, capacity *= 2);
+        capture[length++] = (unsigned char)byte;
+    }
+    fclose(file);
+
+    // split into trace records and the expected UART text
+    unsigned char *records = malloc(length + 1);
+    size_t record_count = 0;
+    host_expected = malloc(length + 1);
+
+    for (size_t i = 0; i < length; i++) {
+        if (capture[i] == TRACE_MARKER && i + 1 < length) {
+            records[record_count++] = capture[++i];
+        } else {
+            host_expected[host_expected_len++] = capture[i];
+        }
+    }
+
+    // skip the start marker, and stop at a second one (the unit was reset)
+    size_t first = 0, last = record_count;
+    if (record_count > 0 && records[0] == TRACE_START) first = 1;
+    for (size_t i = first; i < record_count; i++) {
+        if (records[i] == TRACE_START) {
+            fprintf(stderr, "note: unit restarted at record %zu, replaying the first session only\n", i);
+            last = i;
+            host_expected_len = 0;
+            break;
+        }
+    }
+
+    host_checking = host_expected_len > 0;
+    unsigned long events = 0, transitions = 0;
+    uint32_t warm_lcd_ready_us = 0;
+    double start = host_wall_seconds();
+
+    master_setup();
+    uint32_t boot_busy_us = host_busy_us;
+    uint32_t boot_prompt_us = host_now_us;
+    host_state previous = host_snapshot();
+
+    for (long pass = 0; pass < repeats; pass++) {
+        for (size_t i = first; i < last; i++) {
+            uint8_t record = records[i];
+
+            if (pass == 0 && (long)(i - first) == watchdog_at) {
+                // the uart text can't match once the unit restarts differently to the capture
+                host_watchdog_reset();
+                host_checking = false;
+                if (verbose) printf("[%10.3f s] watchdog reset\n", host_now_us / 1e6);
+                for (int t = 0; t < 16 && !lcd_is_ready(); t++) host_tick();
+                warm_lcd_ready_us = boot_lcd_ready_us;
+            }
+
+            // advance virtual time, then deliver the key (if any)
+            int ticks = (record & TRACE_IDLE) ? (record & TRACE_IDLE_MASK) : (record >> 4);
+            for (int t = 0; t < ticks; t++) host_tick();
+
+            if (!(record & TRACE_IDLE)) host_key(record & 0x0F);
+            host_process();
+            events++;
+
+            // count and optionally print every change of safe state
+            host_state current = host_snapshot();
+            if (host_state_changed(previous, current)) {
+                transitions++;
+                host_digest_byte(current.locked | current.unlocked << 1 | current.disabled << 2);
+                for (int c = 0; c < 16; c++) host_digest_byte(display_line1[c]);
+                for (int c = 0; c < 16; c++) host_digest_byte(display_line2[c]);
+
+                if (verbose) {
+                    printf("[%10.3f s] |%.16s| |%.16s|\n", host_now_us / 1e6, display_line1, display_line2);
+                }
+            }
+            previous = current;
+        }
+
+        // the captured text only covers one pass
+        if (host_checking && host_mismatch < 0 && host_uart_len != host_expected_len) {
+            host_mismatch = (long)host_uart_len;
+        }
+        host_checking = false;
+    }
+
+    double elapsed = host_wall_seconds() - start;
+    if (elapsed <= 0) elapsed = 1e-9;
+
+    // report
+    printf("records:      %lu\n", events);
+    printf("transitions:  %lu\n", transitions);
+    printf("virtual time: %.3f s\n", host_now_us / 1e6);
+    printf("wall time:    %.3f ms (%.0fx real time)\n", elapsed * 1e3, host_now_us / 1e6 / elapsed);
+    printf("rate:         %.0f transitions/s, %.0f records/s\n", transitions / elapsed, events / elapsed);
+    printf("boot:         input ready %lu us, prompt sent %lu us (%lu us busy-waiting), lcd ready %lu us\n",
+        (unsigned long)boot_input_ready_us, (unsigned long)boot_prompt_us, (unsigned long)boot_busy_us,
+        (unsigned long)boot_lcd_ready_us);
+    if (watchdog_at >= 0) {
+        printf("warm restart: lcd ready %lu us after the watchdog reset\n", (unsigned long)warm_lcd_ready_us);
+    }
+    printf("system tick:  %lu ticks lost to long interrupts\n", host_ticks_lost);
+    printf("lcd:          |%.16s| |%.16s|\n", display_line1, display_line2);
+    printf("digest:       %08lx\n", (unsigned long)host_digest);
+
+    printf("lcd bus:      %lu strobes, %lu instructions, %lu data writes\n",
+        hd.strobes, hd_instructions(), hd.ops[HD_OP_DATA]);
+    printf("              %.1f strobes per pass (max %lu) over %lu passes\n",
+        host_passes ? (double)hd.strobes / host_passes : 0.0, host_pass_strobes_max, host_passes);
+    for (int op = 0; op < HD_OP_COUNT; op++) {
+        if (hd.ops[op]) printf("              %-15s %lu\n", hd_op_names[op], hd.ops[op]);
+    }
+    #if LCD_TRANSPORT == LCD_TRANSPORT_TWI
+    printf("twi bus:      %lu transactions, %lu bytes (%.1f per transaction), %u errors\n",
+        host_twi.transactions, host_twi.bytes,
+        host_twi.transactions ? (double)host_twi.bytes / host_twi.transactions : 0.0, _lcd_twi_errors);
+    #endif
+    #if KEYPAD_MODE == KEYPAD_MATRIX
+    printf("keypad:       %dx%d, %u scans/s (%lu scans), %u presses, latency %u-%u ms (avg %.1f), %u ghosted scans\n",
+        KEYPAD_ROWS, KEYPAD_COLUMNS, keypad_stats.scan_rate, (unsigned long)keypad_stats.scans, keypad_stats.presses,
+        keypad_stats.latency_min, keypad_stats.latency_max,
+        keypad_stats.presses ? (double)keypad_stats.latency_total / keypad_stats.presses : 0.0, keypad_stats.ghosted);
+    #endif
+    printf("lcd check:    %lu ddram mismatches, %lu timing/protocol violations\n",
+        host_lcd_mismatches, hd.violations);
+
+    int status = (host_lcd_mismatches || hd.violations) ? 1 : 0;
+
+    if (host_expected_len == 0) {
+        printf("uart check:   skipped (no captured text)\n");
+    } else if (host_mismatch >= 0) {
+        printf("uart check:   MISMATCH at byte %ld\n", host_mismatch);
+        status = 1;
+    } else {
+        printf("uart check:   ok (%zu bytes)\n", host_expected_len);
+    }
+
+    return status;
+}
+
+// * END HOST REPLAY HARNESS * //